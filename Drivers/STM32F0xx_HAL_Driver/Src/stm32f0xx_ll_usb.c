@@ -805,6 +805,46 @@ void USB_WritePMA(USB_TypeDef *USBx, uint8_t *pbUsrBuf, uint16_t wPMABufAddr, ui
   // 获取PMA的目标地址
   pdwVal = (__IO uint16_t *)(BaseAddr + 0x400U + ((uint32_t)wPMABufAddr * PMA_ACCESS));
 
+#if PMA_ACCESS == 1U
+  // PMA连续排列时按半字复制，每次循环4个半字。Cortex-M0不支持非对齐访问，源地址为奇数时逐字节拼出每个半字。
+  // 长度为奇数时最后一个字节单独写入，不会读取源缓冲区之后的数据
+  typedef uint16_t __attribute__((may_alias)) pma_half_t; // 按半字读取字节数组，不违反严格别名规则
+  n = (uint32_t)wNBytes >> 1; // 完整的半字数
+
+  if (((uint32_t)pBuf & 1U) == 0U)
+  {
+    const pma_half_t *pHalf = (const pma_half_t *)pBuf;
+
+    for (i = n; i >= 4U; i -= 4U)
+    {
+      pdwVal[0] = pHalf[0];
+      pdwVal[1] = pHalf[1];
+      pdwVal[2] = pHalf[2];
+      pdwVal[3] = pHalf[3];
+      pdwVal += 4;
+      pHalf += 4;
+    }
+    for (; i != 0U; i--)
+    {
+      *pdwVal++ = *pHalf++;
+    }
+  }
+  else
+  {
+    for (i = n; i != 0U; i--)
+    {
+      temp1 = pBuf[0];
+      temp2 = pBuf[1];
+      *pdwVal++ = (uint16_t)(temp1 | (temp2 << 8));
+      pBuf += 2;
+    }
+  }
+
+  if ((wNBytes & 1U) != 0U)
+  {
+    *pdwVal = pbUsrBuf[wNBytes - 1U];
+  }
+#else
   for (i = n; i != 0U; i--)
   {
     temp1 = *pBuf;  // 获取一个字节
@@ -812,13 +852,10 @@ void USB_WritePMA(USB_TypeDef *USBx, uint8_t *pbUsrBuf, uint16_t wPMABufAddr, ui
     temp2 = temp1 | ((uint16_t)((uint16_t) *pBuf << 8)); // 与下一个字节组成一个半字
     *pdwVal = (uint16_t)temp2;  // 将半字写入PMA
     pdwVal++;
-
-#if PMA_ACCESS > 1U
-    pdwVal++;  // 如果PMA_ACCESS大于1，则跳过一个地址
-#endif
-
+    pdwVal++;  // PMA_ACCESS大于1时跳过一个地址
     pBuf++; // 移动到下一个字节
   }
+#endif
 }
 
 /**
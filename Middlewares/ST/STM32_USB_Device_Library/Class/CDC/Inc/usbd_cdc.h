@@ -120,6 +120,7 @@ typedef struct _USBD_CDC_Itf
   int8_t (* DeInit)(void);    /*!< 指向反初始化函数的指针。这个函数通常在USB设备被移除时被调用，用于清理用户的硬件设备 */
   int8_t (* Control)(uint8_t cmd, uint8_t *pbuf, uint16_t length); /*!< 指向控制函数的指针。这个函数用于处理CDC特定的请求，例如设置线路编码或者设置控制线状态 */
   int8_t (* Receive)(uint8_t *Buf, uint32_t *Len); /*!< 指向接收函数的指针。当接收到新的数据时，这个函数会被调用，用户需要在这个函数中实现数据的接收处理 */
+  int8_t (* TransmitCplt)(uint8_t *Buf, uint32_t *Len, uint8_t epnum); /*!< 指向发送完成函数的指针（可为NULL）。IN传输（包括ZLP）完成、TxState清零后在USB中断中被调用，用户可以在这里启动下一次传输。返回USBD_BUSY表示还有数据要发送，以满包结束的传输不再补发ZLP */
 
 } USBD_CDC_ItfTypeDef; /*!< USB CDC接口类型定义 */
 
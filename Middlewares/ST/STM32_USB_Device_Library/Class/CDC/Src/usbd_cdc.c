@@ -678,18 +678,29 @@ static uint8_t  USBD_CDC_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum)
 
   if (pdev->pClassData != NULL)
   {
-    if ((pdev->ep_in[epnum].total_length > 0U) && ((pdev->ep_in[epnum].total_length % hpcd->IN_ep[epnum].maxpacket) == 0U))
+    /* A transfer ending with a full packet needs a ZLP, unless more data follows */
+    uint8_t zlp = (pdev->ep_in[epnum].total_length > 0U) && ((pdev->ep_in[epnum].total_length % hpcd->IN_ep[epnum].maxpacket) == 0U);
+
+    /* Update the packet total length */
+    pdev->ep_in[epnum].total_length = 0U;
+    hcdc->TxState = 0U;
+
+    /* Notify the interface so it can chain the next transfer. USBD_BUSY means it still has
+       data queued: that data ends the host's read, so no ZLP is needed */
+    if (((USBD_CDC_ItfTypeDef *)pdev->pUserData)->TransmitCplt != NULL)
     {
-      /* Update the packet total length */
-      pdev->ep_in[epnum].total_length = 0U;
+      if (((USBD_CDC_ItfTypeDef *)pdev->pUserData)->TransmitCplt(hcdc->TxBuffer, &hcdc->TxLength, epnum) == USBD_BUSY)
+      {
+        zlp = 0U;
+      }
+    }
 
+    if (zlp && (hcdc->TxState == 0U))
+    {
       /* Send ZLP */
+      hcdc->TxState = 1U;
       USBD_LL_Transmit(pdev, epnum, NULL, 0U);
     }
-    else
-    {
-      hcdc->TxState = 0U;
-    }
     return USBD_OK;
   }
   else
@@ -135,6 +135,8 @@ USBD_StatusTypeDef  USBD_LL_PrepareReceive(USBD_HandleTypeDef *pdev,
                                            uint16_t  size);
 
 uint32_t USBD_LL_GetRxDataSize(USBD_HandleTypeDef *pdev, uint8_t  ep_addr);
+void USBD_LL_SetRxPosition(USBD_HandleTypeDef *pdev, uint8_t ep_addr, uint8_t *pbuf);
+void USBD_LL_SetRxNak(USBD_HandleTypeDef *pdev, uint8_t ep_addr, uint8_t nak);
 void  USBD_LL_Delay(uint32_t Delay);
 
 /**
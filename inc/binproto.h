@@ -0,0 +1,40 @@
+#ifndef _BINPROTO_H
+#define _BINPROTO_H
+
+#include "can.h"
+
+// 记录头字节：bit7-6 记录类型，bit5 扩展帧，bit4 远程帧，bit3-0 DLC（仅CAN帧记录）
+#define BINPROTO_TYPE_FRAME  (0 << 6) // CAN帧：主机->设备为发送，设备->主机为接收
+#define BINPROTO_TYPE_TEXT   (1 << 6) // 文本：主机->设备为ASCII slcan命令（不含'\r'），设备->主机为命令应答
+#define BINPROTO_TYPE_STATUS (2 << 6) // 状态：主机发送空记录请求，设备回复固定布局的状态记录
+#define BINPROTO_TYPE_FRAME_TS (3 << 6) // 带时间戳的接收CAN帧（设备->主机，时间戳模式打开时）：数据后附加4字节微秒时间戳
+#define BINPROTO_TYPE_MASK   (3 << 6)
+#define BINPROTO_FLAG_EXT    (1 << 5)
+#define BINPROTO_FLAG_RTR    (1 << 4)
+#define BINPROTO_DLC_MASK    0x0F
+
+// 状态记录的子类型（头字节bit5-0，设备->主机）
+#define BINPROTO_STATUS_STATS  0 // 统计信息，见binproto_send_status
+#define BINPROTO_STATUS_TXCONF 1 // 发送确认：标签1字节、结果1字节（enum can_txconf_result）
+#define BINPROTO_STATUS_CREDIT 2 // 发送信用：返回给主机的信用数1字节
+#define BINPROTO_STATUS_LOSS   3 // 接收丢失：第一个丢失帧的序号2字节、丢失帧数4字节、第一个丢失帧的到达时间4字节
+
+#define BINPROTO_CRC_LEN  2  // CRC-32（与zlib相同）的低16位，小端
+#define BINPROTO_TEXT_MAX 48 // 一个记录中文本应答的最大长度，更长的应答分成多个记录发送
+
+// 编码后的最大记录长度：COBS开销1字节 + 记录 + 分隔符0x00
+#define BINPROTO_MTU (1 + 1 + BINPROTO_TEXT_MAX + BINPROTO_CRC_LEN + 1)
+#define BINPROTO_FRAME_MTU (1 + 1 + 4 + 8 + 4 + 2 + BINPROTO_CRC_LEN + 1) // 扩展帧，8字节数据，带时间戳和序号
+
+// Prototypes
+void binproto_init(void);
+void binproto_set_enabled(uint8_t enabled);
+uint8_t binproto_enabled(void);
+int8_t binproto_parse_frame(uint8_t *buf, CAN_RxHeaderTypeDef *frame_header, uint8_t* frame_data);
+int8_t binproto_parse_txconf(uint8_t *buf, can_txconf_t *conf);
+int8_t binproto_parse_credits(uint8_t *buf, uint8_t credits);
+int8_t binproto_parse_loss(uint8_t *buf, can_rxloss_t *loss);
+int8_t binproto_parse_str(uint8_t *buf, uint8_t len);
+void binproto_send(uint8_t type, uint8_t *payload, uint8_t len);
+
+#endif // _BINPROTO_H
@@ -1,6 +1,8 @@
 #ifndef _CAN_H
 #define _CAN_H
 
+#include "ring.h"
+
 enum can_bitrate {
     CAN_BITRATE_10K = 0,
     CAN_BITRATE_20K,
@@ -15,6 +17,19 @@ enum can_bitrate {
 	CAN_BITRATE_INVALID,
 };
 
+// Bit timing solver
+#define CAN_SAMPLE_POINT_DEFAULT 875 // Sample point in per mille used for presets and when none is given (CiA 301)
+#define CAN_BTR_TIMING_MASK (CAN_BTR_BRP | CAN_BTR_TS1 | CAN_BTR_TS2 | CAN_BTR_SJW) // Timing fields of the BTR register
+
+// Distribution of accepted IDs across the two hardware receive FIFOs
+enum can_fifo_mode {
+    CAN_FIFO_SINGLE = 0, // All IDs into FIFO0 (default)
+    CAN_FIFO_SPLIT_PARITY, // Even IDs into FIFO0, odd IDs into FIFO1
+    CAN_FIFO_SPLIT_PRIORITY, // Upper half of the ID range (low priority) into FIFO1
+
+	CAN_FIFO_MODE_INVALID,
+};
+
 typedef enum can_bus_state {
     OFF_BUS = 0,
     ON_BUS = 1,
@@ -22,33 +37,150 @@ typedef enum can_bus_state {
 
 
 // CAN transmit buffering
-#define TXQUEUE_LEN 28 // Number of buffers allocated
-#define TXQUEUE_DATALEN 8 // CAN DLC length of data buffers
+#define TXQUEUE_LEN 32 // Number of buffers allocated (17 bytes each)
+#define TXQUEUE_NONE 0xFF // End of a slot list
+#define TXCREDIT_BATCH 4 // Freed transmit slots are returned to the host in batches of this size, or as soon as the queue is empty
+
+// Order in which queued frames are loaded into the transmit mailboxes
+enum can_tx_order {
+    CAN_TX_ORDER_FIFO = 0, // In the order they were queued (default)
+    CAN_TX_ORDER_PRIORITY, // By ID priority, in queue order among equal IDs; lower-priority mailboxes are preempted
+
+	CAN_TX_ORDER_INVALID,
+};
 
+// Transmit frame in the layout of the bxCAN mailbox registers, encoded once by can_tx()
+typedef struct cantxframe_
+{
+	uint32_t tir; // CAN_TIxR without TXRQ: identifier, IDE and RTR bits; also the arbitration priority (lower wins)
+	uint32_t tdtr; // DLC in bits 3-0, host-supplied tag in bits 31-24 (only the DLC is written to the mailbox)
+	uint32_t tdlr; // Data bytes 0-3
+	uint32_t tdhr; // Data bytes 4-7
+} can_txframe_t;
+
+// Slots are linked in send order; a slot stays allocated while its frame is in a mailbox
 typedef struct cantxbuf_
 {
-	uint8_t data[TXQUEUE_LEN][TXQUEUE_DATALEN]; // Data buffer
-	CAN_TxHeaderTypeDef header[TXQUEUE_LEN]; // Header buffer
-	uint8_t head; // Head pointer
-	uint8_t tail; // Tail pointer
-	uint8_t full; // TODO: Set this when we are full, clear when the tail moves one.
+	can_txframe_t frame[TXQUEUE_LEN]; // Frame buffer
+	uint8_t next[TXQUEUE_LEN]; // Next slot in send order, or in the free list
+	uint8_t head; // First slot waiting for a mailbox, TXQUEUE_NONE if none
+	uint8_t tail; // Last slot waiting for a mailbox
+	uint8_t free; // First free slot
+	uint8_t count; // Allocated slots: waiting frames plus frames in mailboxes
 } can_txbuf_t;
 
 
+// Transmit confirmations (filled from the CAN TX interrupt when enabled, drained by the main loop)
+#define TXCONF_LEN 8 // Number of confirmations allocated (power of two)
+
+enum can_txconf_result {
+    CAN_TXCONF_OK = 0, // Frame was acknowledged on the bus
+    CAN_TXCONF_ARB_LOST, // Arbitration lost (only reported without automatic retransmission)
+    CAN_TXCONF_ERROR, // Transmit error (only reported without automatic retransmission), or the mailbox could not be loaded
+    CAN_TXCONF_ABORTED, // Transmission aborted, for example by closing the channel
+};
+
+typedef struct cantxconf_
+{
+	uint8_t tag; // Tag of the frame
+	uint8_t result; // Outcome, see enum can_txconf_result
+} can_txconf_t;
+
+typedef struct cantxconfbuf_
+{
+	can_txconf_t conf[TXCONF_LEN]; // Confirmation buffer
+	ring_t ring; // Produced by the TX interrupt, consumed by the main loop
+} can_txconfbuf_t;
+
+
+// CAN receive buffering (filled from the CAN RX interrupt, drained by the main loop)
+#ifdef PROFILE
+#define RXQUEUE_LEN 32 // Profiling builds give half of the queue to the profiler statistics
+#else
+#define RXQUEUE_LEN 64 // Number of frames allocated (16 bytes each, power of two)
+#endif
+#define RXQUEUE_RESERVE (RXQUEUE_LEN / 4) // Slots kept free for high-priority frames, or shed from the front, under overload
+
+// What to give up when frames arrive faster than the host takes them
+enum can_rx_policy {
+    CAN_RX_DROP_NEWEST = 0, // Frames that do not fit into the receive queue are lost (default)
+    CAN_RX_DROP_OLDEST, // The main loop sheds the oldest queued frames while the USB link is blocked, keeping the reserve free
+    CAN_RX_DROP_PRIORITY, // Low-priority frames (upper half of the ID range) may not use the reserve
+
+	CAN_RX_POLICY_INVALID,
+};
+
+#define CAN_RXFRAME_LOSS 1 // Reserved RIR bit 0: the slot is a loss marker with the count in rdlr and the first loss time in rdtr
+#define CAN_RXFRAME_LOW_PRIORITY (1UL << 31) // Top ID bit in RIR for both ID types (standard >= 0x400, extended >= 0x10000000)
+
+// Received frame in the layout of the bxCAN FIFO mailbox registers
+typedef struct canrxframe_
+{
+	uint32_t rir; // CAN_RIxR: identifier, IDE and RTR bits
+	uint32_t rdtr; // DLC in bits 3-0, arrival time in microseconds (low 24 bits of TIM2) in bits 31-8, extended to 32 bits by can_rx()
+	uint32_t rdlr; // Data bytes 0-3
+	uint32_t rdhr; // Data bytes 4-7, directly after rdlr so the eight data bytes can be read in place
+} can_rxframe_t;
+
+typedef struct canrxbuf_
+{
+	can_rxframe_t frame[RXQUEUE_LEN]; // Frame buffer
+	ring_t ring; // Produced by the RX interrupt, consumed by the main loop; overflows count dropped frames
+} can_rxbuf_t;
+
+// Frames lost before they could be sent to the host, reported in-band before the next received frame
+typedef struct canrxloss_
+{
+	uint32_t count; // Number of lost frames (hardware FIFO overruns count as one)
+	uint32_t time; // Arrival time of the first lost frame in microseconds
+	uint16_t seq; // Sequence number of the first lost frame
+} can_rxloss_t;
+
+// Receive statistics, indexed by hardware FIFO number
+typedef struct canrxstats_
+{
+	uint32_t frames[2]; // Frames moved from each hardware FIFO into the receive queue
+	uint32_t overruns[2]; // Hardware FIFO overruns (frames lost in the bxCAN)
+} can_rxstats_t;
+
+
 // Prototypes
 void can_init(void);
 void can_enable(void);
 void can_disable(void);
 void can_set_bitrate(enum can_bitrate bitrate);
+HAL_StatusTypeDef can_set_bittiming(uint32_t bitrate, uint32_t sample_point);
+HAL_StatusTypeDef can_set_btr(uint32_t btr);
 void can_set_silent(uint8_t silent);
 void can_set_autoretransmit(uint8_t autoretransmit);
-uint32_t can_tx(CAN_TxHeaderTypeDef *tx_msg_header, uint8_t *tx_msg_data);
-uint32_t can_rx(CAN_RxHeaderTypeDef *rx_msg_header, uint8_t *rx_msg_data);
+void can_set_fifo_mode(enum can_fifo_mode mode);
+HAL_StatusTypeDef can_set_tx_order(enum can_tx_order order);
+void can_set_txconf(uint8_t enable);
+void can_set_credits(uint8_t enable);
+uint8_t can_credits_due(void);
+void can_credits_sent(uint8_t credits);
+uint8_t can_get_txconf(void);
+uint32_t can_tx(CAN_TxHeaderTypeDef *tx_msg_header, uint8_t *tx_msg_data, uint8_t tag);
+uint32_t can_rx(CAN_RxHeaderTypeDef *rx_msg_header, uint8_t **rx_msg_data);
+void can_rx_release(void);
+void can_rx_discard(void);
+void can_rx_overload(void);
+uint32_t can_rx_loss(can_rxloss_t *loss);
+void can_rx_loss_sent(void);
+uint16_t can_rx_seq(void);
+void can_set_rx_policy(enum can_rx_policy policy);
+void can_set_rx_seq(uint8_t enable);
+uint8_t can_get_rx_seq(void);
+uint32_t can_txconf_rx(can_txconf_t *conf);
 
 
 void can_process(void);
+void can_tx_refill(void);
 
 uint8_t is_can_msg_pending(uint8_t fifo);
 CAN_HandleTypeDef* can_gethandle(void);
+const can_rxstats_t* can_get_rxstats(void);
+const ring_t* can_get_rxring(void);
+const ring_t* can_get_txconfring(void);
 
 #endif // _CAN_H
@@ -10,6 +10,9 @@ typedef enum _error_t
 	ERR_CANRXFIFO_OVERFLOW,
 	ERR_FULLBUF_CANTX,
 	ERR_FULLBUF_USBRX,
+	ERR_FULLBUF_CANRX,
+	ERR_CANRXFIFO1_OVERFLOW,
+	ERR_FULLBUF_TXCONF,
 
 	ERR_MAX
 } error_t;
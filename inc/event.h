@@ -0,0 +1,18 @@
+#ifndef _EVENT_H
+#define _EVENT_H
+
+#include <stdint.h>
+
+// Work for the main loop, posted by interrupts (and by the main loop itself when it leaves work behind)
+#define EVENT_USB_RX (1UL << 0) // Data in the USB receive ring (cdc_process)
+#define EVENT_USB_TX (1UL << 1) // Space freed in the USB transmit ring: retry records that did not fit
+#define EVENT_CAN_RX (1UL << 2) // Frame or loss marker in the CAN receive queue
+#define EVENT_CAN_TX (1UL << 3) // Transmit queue slot freed: transmit confirmations and credits to report
+#define EVENT_TICK   (1UL << 4) // SysTick: LED timers
+
+// Prototypes
+void event_post(uint32_t events);
+uint32_t event_take(void);
+void event_wait(void);
+
+#endif // _EVENT_H
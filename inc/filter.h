@@ -0,0 +1,40 @@
+#ifndef _FILTER_H
+#define _FILTER_H
+
+#include "can.h"
+
+// Acceptance filter set, compiled into the bxCAN filter banks
+#define FILTER_BANKS 14 // Filter banks of the bxCAN on the STM32F042
+#define FILTER_STD_IDS 2048 // Number of 11-bit identifiers
+#define FILTER_STD_WORDS (FILTER_STD_IDS / 32) // Words of the standard ID bitmap
+#define FILTER_EXT_MAX 32 // Capacity of the extended ID table
+#define FILTER_URGENT_MAX 4 // Capacity of the latency-critical ID/mask table
+
+// Software filter statistics, indexed by frame format (0: standard, 1: extended)
+typedef struct filterstats_
+{
+	uint32_t hits[2]; // Frames passed on to the host
+	uint32_t drops[2]; // Frames accepted by the hardware banks but rejected in software
+} filter_stats_t;
+
+// Latency-critical ID/mask pair in the 32-bit filter register layout (STID | EXID | IDE), compared like a hardware mask filter
+typedef struct filterurgent_
+{
+	uint32_t id;
+	uint32_t mask; // Set bits must match; always includes IDE so standard and extended entries never alias
+} filter_urgent_t;
+
+// Prototypes
+void filter_apply(void);
+void filter_set_fifo_mode(enum can_fifo_mode mode);
+void filter_clear(void);
+HAL_StatusTypeDef filter_add_std(uint32_t id, uint32_t mask);
+HAL_StatusTypeDef filter_add_ext(uint32_t id);
+uint8_t filter_banks_used(void);
+uint8_t filter_match(CAN_RxHeaderTypeDef *frame_header);
+void filter_clear_urgent(void);
+HAL_StatusTypeDef filter_add_urgent(uint32_t ide, uint32_t id, uint32_t mask);
+uint8_t filter_urgent(CAN_RxHeaderTypeDef *frame_header);
+const filter_stats_t* filter_get_stats(void);
+
+#endif // _FILTER_H
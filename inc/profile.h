@@ -0,0 +1,53 @@
+#ifndef _PROFILE_H
+#define _PROFILE_H
+
+#include <stdint.h>
+
+// Stages measured by the profiler (build with PROFILE=1)
+enum profile_stage {
+    PROFILE_USB_IRQ = 0, // HAL_PCD_IRQHandler
+    PROFILE_CAN_IRQ, // HAL_CAN_IRQHandler and mailbox refill
+    PROFILE_LOOP, // One main loop pass, from wakeup to sleep
+    PROFILE_CDC_PROCESS, // cdc_process: command parsing and execution
+    PROFILE_TX_REPORT, // Transmit confirmation and credit records
+    PROFILE_RX_FORWARD, // Forwarding one received frame or loss record, including the encoder
+    PROFILE_ENCODE, // slcan_parse_frame / binproto_parse_frame alone
+
+    PROFILE_STAGES,
+};
+
+#define PROFILE_BINS 8 // Histogram bins: below 64 cycles, then one bin per factor of 4, the last one open-ended
+
+// Accumulated cycle counts of one stage (CPU cycles at 48 MHz)
+typedef struct profilestats_
+{
+	uint32_t count; // Completed runs
+	uint32_t min;
+	uint32_t max;
+	uint64_t sum; // For the average
+	uint32_t hist[PROFILE_BINS]; // Runs by duration: < 64, < 256, < 1K, ... , >= 256K cycles
+} profile_stats_t;
+
+#ifdef PROFILE
+
+// Mark the entry and exit of a stage within one block. Entry and exit are each a few dozen cycles,
+// a calibrated empty measurement is subtracted from every sample.
+#define PROFILE_BEGIN(stage) uint32_t profile_start_##stage = profile_now()
+#define PROFILE_END(stage) profile_record(stage, profile_start_##stage)
+
+// Prototypes
+void profile_init(void);
+uint32_t profile_now(void);
+void profile_record(enum profile_stage stage, uint32_t start);
+void profile_clear(void);
+void profile_get_stats(enum profile_stage stage, profile_stats_t *stats);
+const char* profile_stage_name(enum profile_stage stage);
+
+#else
+
+#define PROFILE_BEGIN(stage)
+#define PROFILE_END(stage)
+
+#endif // PROFILE
+
+#endif // _PROFILE_H
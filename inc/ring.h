@@ -0,0 +1,30 @@
+#ifndef _RING_H
+#define _RING_H
+
+// Single-producer single-consumer ring indices, shared between one interrupt and the main loop.
+// The user owns the slot storage; the ring only tracks which slots are filled.
+// Indices run freely and wrap at 2^16, so every slot is usable and the size must be a power of two (at most 32768).
+typedef struct ring_
+{
+	volatile uint16_t head; // Free-running write index, only written by the producer
+	volatile uint16_t tail; // Free-running read index, only written by the consumer
+	uint16_t mask; // Size - 1
+	uint16_t high_water; // Highest fill level seen by the producer
+	uint32_t overflows; // Writes rejected because the ring was full
+} ring_t;
+
+#define RING_INIT(size) { 0, 0, (size) - 1, 0, 0 } // Static initializer
+#define RING_SIZE_OK(size) ((size) > 0 && (size) <= 32768 && ((size) & ((size) - 1)) == 0) // For _Static_assert on the storage size
+
+#define RING_HEAD(ring) ((ring)->head & (ring)->mask) // Next slot to write (producer)
+#define RING_TAIL(ring) ((ring)->tail & (ring)->mask) // Next slot to read (consumer)
+#define RING_SIZE(ring) ((ring)->mask + 1)
+
+// Prototypes
+uint16_t ring_used(ring_t *ring);
+uint16_t ring_space(ring_t *ring);
+uint8_t ring_claim(ring_t *ring, uint16_t n);
+void ring_publish(ring_t *ring, uint16_t n);
+void ring_release(ring_t *ring, uint16_t n);
+
+#endif // _RING_H
@@ -1,11 +1,39 @@
 #ifndef _SLCAN_H
 #define _SLCAN_H
 
+#include "can.h"
+
+// slcan_parse_str的返回值
+enum slcan_err {
+    SLCAN_OK = 0,
+    SLCAN_ERR_CMD = -1,   // 未知命令
+    SLCAN_ERR_LEN = -2,   // 命令长度与命令或DLC不符
+    SLCAN_ERR_HEX = -3,   // 非法的数字字符（十六进制或十进制）
+    SLCAN_ERR_RANGE = -4, // ID、DLC或参数超出范围
+    SLCAN_ERR_BUSY = -5,  // 通道已打开，不能修改配置
+};
+
+// 接收帧的时间戳格式（Z命令）
+enum slcan_timestamp {
+    SLCAN_TIMESTAMP_OFF = 0, // 不附加时间戳（默认）
+    SLCAN_TIMESTAMP_MS,      // Lawicel格式：4个十六进制字符，毫秒，0-59999循环
+    SLCAN_TIMESTAMP_US,      // 8个十六进制字符，微秒，32位回绕（非标准）
+
+    SLCAN_TIMESTAMP_INVALID,
+};
+
 int8_t slcan_parse_frame(uint8_t *buf, CAN_RxHeaderTypeDef *frame_header, uint8_t* frame_data);
+int8_t slcan_parse_txconf(uint8_t *buf, can_txconf_t *conf);
+int8_t slcan_parse_credits(uint8_t *buf, uint8_t credits);
+int8_t slcan_parse_loss(uint8_t *buf, can_rxloss_t *loss);
 int8_t slcan_parse_str(uint8_t *buf, uint8_t len);
+uint8_t slcan_get_timestamp_mode(void);
+
+// maximum rx buffer len: extended CAN frame with microsecond timestamp
+#define SLCAN_MTU 35 // sizeof("T1111222281122334455667788AABBCCDD\r")
 
-// maximum rx buffer len: extended CAN frame with timestamp 
-#define SLCAN_MTU 30 // (sizeof("T1111222281122334455667788EA5F\r")+1)
+// maximum encoded received frame: SLCAN_MTU plus a 4-character sequence number
+#define SLCAN_FRAME_MTU (SLCAN_MTU + 4)
 
 #define SLCAN_STD_ID_LEN 3
 #define SLCAN_EXT_ID_LEN 8
@@ -52,7 +52,7 @@
 #define HAL_CAN_MODULE_ENABLED
 //#define HAL_CEC_MODULE_ENABLED
 //#define HAL_COMP_MODULE_ENABLED
-//#define HAL_CRC_MODULE_ENABLED
+#define HAL_CRC_MODULE_ENABLED
 //#define HAL_CRYP_MODULE_ENABLED
 //#define HAL_TSC_MODULE_ENABLED
 //#define HAL_DAC_MODULE_ENABLED
@@ -2,23 +2,32 @@
 #define __USBD_CDC_IF_H__
 
 #include "usbd_cdc.h"
+#include "ring.h"
 
 // 缓冲区设置
-#define TX_BUF_SIZE  64 // 线性TX缓冲区大小
-#define NUM_RX_BUFS 6 // FIFO中RX缓冲区的数量
-#define RX_BUF_SIZE CDC_DATA_FS_MAX_PACKET_SIZE // RX缓冲区项的大小
-
-// 接收缓冲：循环缓冲区 FIFO
+#define TX_BUF_SIZE  CDC_DATA_FS_MAX_PACKET_SIZE // 一个满USB IN包的大小
+#define TX_RING_SIZE 256 // TX环形缓冲区大小（2的幂），主循环只向其中写入
+#define TX_CLAIM_MAX 40 // cdc_tx_claim一次最多预留的字节数（编码器直接写入的最长记录）
+#define TX_LATENCY_SOF 1 // 未填满的IN包最多等待的SOF数（每个SOF为1 ms），超时后立即发送
+#define RX_RING_SIZE 256 // RX字节环形缓冲区大小（2的幂）。放不下三个满包时OUT端点回复NAK，主机暂停发送
+#define RX_BUF_SIZE CDC_DATA_FS_MAX_PACKET_SIZE // 一个满USB OUT包的大小
+
+// 接收缓冲：单生产者（USB中断）单消费者（主循环）的字节环形缓冲区
 typedef struct _usbrx_buf_
 {
-	// 接收缓冲：循环缓冲 FIFO
-	uint8_t buf[NUM_RX_BUFS][RX_BUF_SIZE]; // 接收缓冲区
-	uint32_t msglen[NUM_RX_BUFS];          // 各缓冲区消息长度
-	uint8_t head;                          // 头指针，指向下一个可写空间
-	uint8_t tail;                          // 尾指针，指向下一个可读空间
+	uint8_t buf[RX_RING_SIZE + RX_BUF_SIZE]; // 接收数据。末尾多出一个包的空间：包总是接收到head处，越过末尾的部分再搬到开头
+	ring_t ring;                           // USB中断生产，主循环消费；溢出次数为OUT端点因缓冲区不足而暂停的次数
 
 } usbrx_buf_t;  // USB接收缓冲区类型定义
 
+// 发送缓冲：单生产者（主循环）单消费者（USB中断）的字节环形缓冲区
+typedef struct _usbtx_buf_
+{
+	uint8_t buf[TX_RING_SIZE + TX_CLAIM_MAX]; // 发送数据。末尾多出一条记录的空间：记录总是连续写入head处，越过末尾的部分再搬到开头
+	ring_t ring;                           // 主循环生产，USB中断消费
+
+} usbtx_buf_t;  // USB发送缓冲区类型定义
+
 
 // CDC Interface callback.
 extern USBD_CDC_ItfTypeDef USBD_Interface_fops_FS;
@@ -26,7 +35,14 @@ extern USBD_CDC_ItfTypeDef USBD_Interface_fops_FS;
 
 // Prototypes
 uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len);
+uint8_t* cdc_tx_claim(uint16_t len);
+void cdc_tx_publish(uint16_t len);
+void cdc_tx_flush(void);
+uint16_t cdc_tx_space(void);
 void cdc_process(void);
+void cdc_sof(void);
+const ring_t* cdc_get_rxring(void);
+const ring_t* cdc_get_txring(void);
 
 
 
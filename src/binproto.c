@@ -0,0 +1,419 @@
+//
+// binproto：紧凑二进制帧协议。记录使用COBS分帧（以0x00分隔），由硬件CRC单元校验，
+// 与ASCII slcan命令共存：ASCII命令可以封装在文本记录中发送。
+//
+
+#include "stm32f0xx_hal.h"
+#include "can.h"
+#include "error.h"
+#include "slcan.h"
+#include "binproto.h"
+#include "usbd_cdc_if.h"
+
+
+// Private variables
+static CRC_HandleTypeDef crc_handle;
+static volatile uint8_t binproto_mode = 0; // 0: ASCII slcan，1: 二进制记录
+
+
+// 初始化硬件CRC单元：默认多项式0x04C11DB7，初值0xFFFFFFFF，输入输出按位反转，
+// 取反后与zlib的crc32()结果相同，便于主机端校验。
+void binproto_init(void)
+{
+    __HAL_RCC_CRC_CLK_ENABLE();
+
+    crc_handle.Instance = CRC;
+    crc_handle.Init.DefaultInitValueUse = DEFAULT_INIT_VALUE_ENABLE;
+    crc_handle.Init.InputDataInversionMode = CRC_INPUTDATA_INVERSION_BYTE;
+    crc_handle.Init.OutputDataInversionMode = CRC_OUTPUTDATA_INVERSION_ENABLE;
+    crc_handle.InputDataFormat = CRC_INPUTDATA_FORMAT_BYTES;
+
+    if (HAL_CRC_Init(&crc_handle) != HAL_OK)
+    {
+        error_assert(ERR_PERIPHINIT);
+    }
+}
+
+
+// 选择协议：0为ASCII slcan，1为二进制记录
+void binproto_set_enabled(uint8_t enabled)
+{
+    binproto_mode = enabled;
+}
+
+
+// 二进制模式是否启用
+uint8_t binproto_enabled(void)
+{
+    return binproto_mode;
+}
+
+
+// 计算记录的校验值（CRC-32的低16位）
+static uint16_t binproto_crc(uint8_t *buf, uint8_t len)
+{
+    return (uint16_t)~HAL_CRC_Calculate(&crc_handle, (uint32_t *)buf, len);
+}
+
+
+// COBS编码：把len字节的src编码到dst并追加分隔符0x00，返回写入的字节数。
+// 记录长度远小于254字节，因此不需要处理0xFF长块。
+static uint8_t binproto_cobs_encode(uint8_t *src, uint8_t len, uint8_t *dst)
+{
+    uint8_t code_pos = 0;
+    uint8_t out = 1;
+    uint8_t code = 1;
+
+    for (uint8_t i = 0; i < len; i++)
+    {
+        if (src[i] == 0)
+        {
+            dst[code_pos] = code;
+            code_pos = out++;
+            code = 1;
+        }
+        else
+        {
+            dst[out++] = src[i];
+            code++;
+        }
+    }
+    dst[code_pos] = code;
+    dst[out++] = 0;
+
+    return out;
+}
+
+
+// COBS原地解码（不含分隔符），返回解码后的长度，编码无效时返回-1
+static int16_t binproto_cobs_decode(uint8_t *buf, uint8_t len)
+{
+    uint8_t in = 0;
+    uint8_t out = 0;
+
+    while (in < len)
+    {
+        uint8_t code = buf[in++];
+        if (code == 0 || in + code - 1 > len)
+        {
+            return -1;
+        }
+
+        for (uint8_t i = 1; i < code; i++)
+        {
+            buf[out++] = buf[in++];
+        }
+
+        if (code < 0xFF && in < len)
+        {
+            buf[out++] = 0;
+        }
+    }
+
+    return out;
+}
+
+
+// 把一个小端32位值写入缓冲区
+static uint8_t *binproto_put32(uint8_t *p, uint32_t val)
+{
+    *p++ = val;
+    *p++ = val >> 8;
+    *p++ = val >> 16;
+    *p++ = val >> 24;
+    return p;
+}
+
+
+// 追加CRC并COBS编码记录，返回编码后的长度
+static uint8_t binproto_seal(uint8_t *raw, uint8_t len, uint8_t *buf)
+{
+    uint16_t crc = binproto_crc(raw, len);
+    raw[len++] = crc & 0xFF;
+    raw[len++] = crc >> 8;
+
+    return binproto_cobs_encode(raw, len, buf);
+}
+
+
+/**
+ * \brief 将接收到的CAN帧编码为二进制记录（slcan_parse_frame的二进制版本）。
+ *
+ * 记录布局：头字节、ID（标准帧2字节，扩展帧4字节，小端）、DLC个数据字节（远程帧没有数据）、
+ * 时间戳模式打开时的4字节微秒时间戳、接收序号打开时的2字节序号、校验值2字节，经过COBS编码并以0x00结束。8字节数据的扩展帧在线路上为17字节，ASCII格式为27字节。
+ *
+ * \param buf 输出缓冲区，至少BINPROTO_FRAME_MTU字节。
+ * \param frame_header 接收到的CAN帧头部。
+ * \param frame_data 接收到的CAN帧数据。
+ *
+ * \return 编码后的字节数。
+ */
+int8_t binproto_parse_frame(uint8_t *buf, CAN_RxHeaderTypeDef *frame_header, uint8_t* frame_data)
+{
+    uint8_t raw[1 + 4 + 8 + 4 + 2 + BINPROTO_CRC_LEN];
+    uint8_t len = 0;
+    uint8_t dlc = frame_header->DLC & BINPROTO_DLC_MASK;
+
+    raw[len] = BINPROTO_TYPE_FRAME | dlc;
+    if (frame_header->RTR == CAN_RTR_REMOTE)
+    {
+        raw[len] |= BINPROTO_FLAG_RTR;
+        dlc = 0;
+    }
+
+    if (frame_header->IDE == CAN_ID_EXT)
+    {
+        raw[len++] |= BINPROTO_FLAG_EXT;
+        raw[len++] = frame_header->ExtId;
+        raw[len++] = frame_header->ExtId >> 8;
+        raw[len++] = frame_header->ExtId >> 16;
+        raw[len++] = frame_header->ExtId >> 24;
+    }
+    else
+    {
+        len++;
+        raw[len++] = frame_header->StdId;
+        raw[len++] = frame_header->StdId >> 8;
+    }
+
+    for (uint8_t j = 0; j < dlc && j < 8; j++)
+    {
+        raw[len++] = frame_data[j];
+    }
+
+    // 时间戳模式打开时附加微秒时间戳（两种模式在二进制记录中都使用微秒）
+    if (slcan_get_timestamp_mode() != SLCAN_TIMESTAMP_OFF)
+    {
+        raw[0] |= BINPROTO_TYPE_FRAME_TS;
+        binproto_put32(&raw[len], frame_header->Timestamp);
+        len += 4;
+    }
+
+    // 接收序号打开时附加2字节序号（小端）
+    if (can_get_rx_seq())
+    {
+        uint16_t seq = can_rx_seq();
+        raw[len++] = seq;
+        raw[len++] = seq >> 8;
+    }
+
+    return binproto_seal(raw, len, buf);
+}
+
+
+/**
+ * \brief 将一个发送结果编码为发送确认记录（状态记录，子类型BINPROTO_STATUS_TXCONF）。
+ *
+ * \param buf 输出缓冲区，至少BINPROTO_FRAME_MTU字节。
+ * \param conf 发送结果。
+ *
+ * \return 编码后的字节数。
+ */
+int8_t binproto_parse_txconf(uint8_t *buf, can_txconf_t *conf)
+{
+    uint8_t raw[1 + 2 + BINPROTO_CRC_LEN];
+
+    raw[0] = BINPROTO_TYPE_STATUS | BINPROTO_STATUS_TXCONF;
+    raw[1] = conf->tag;
+    raw[2] = conf->result;
+
+    return binproto_seal(raw, 3, buf);
+}
+
+
+/**
+ * \brief 将一条接收丢失记录编码为丢失记录（状态记录，子类型BINPROTO_STATUS_LOSS）：
+ * 第一个丢失帧的序号2字节、丢失的帧数4字节、第一个丢失帧的到达时间4字节，均为小端。
+ *
+ * \param buf 输出缓冲区，至少BINPROTO_FRAME_MTU字节。
+ * \param loss 丢失记录。
+ *
+ * \return 编码后的字节数。
+ */
+int8_t binproto_parse_loss(uint8_t *buf, can_rxloss_t *loss)
+{
+    uint8_t raw[1 + 2 + 4 + 4 + BINPROTO_CRC_LEN];
+
+    raw[0] = BINPROTO_TYPE_STATUS | BINPROTO_STATUS_LOSS;
+    raw[1] = loss->seq;
+    raw[2] = loss->seq >> 8;
+    binproto_put32(&raw[3], loss->count);
+    binproto_put32(&raw[7], loss->time);
+
+    return binproto_seal(raw, 11, buf);
+}
+
+
+/**
+ * \brief 将返回给主机的发送信用编码为信用记录（状态记录，子类型BINPROTO_STATUS_CREDIT）。
+ *
+ * \param buf 输出缓冲区，至少BINPROTO_FRAME_MTU字节。
+ * \param credits 信用数。
+ *
+ * \return 编码后的字节数。
+ */
+int8_t binproto_parse_credits(uint8_t *buf, uint8_t credits)
+{
+    uint8_t raw[1 + 1 + BINPROTO_CRC_LEN];
+
+    raw[0] = BINPROTO_TYPE_STATUS | BINPROTO_STATUS_CREDIT;
+    raw[1] = credits;
+
+    return binproto_seal(raw, 2, buf);
+}
+
+
+/**
+ * \brief 编码并发送一个文本或状态记录。
+ *
+ * 超过BINPROTO_TEXT_MAX字节的内容分成多个相同类型的连续记录发送，主机按顺序拼接文本记录，直到'\r'为止。
+ * 发送前先检查TX环形缓冲区能否放下所有记录，放不下时整条应答都不发送，主机不会收到不完整的应答。
+ *
+ * \param type 记录类型（BINPROTO_TYPE_*）。
+ * \param payload 记录内容。
+ * \param len 记录内容的长度。
+ */
+void binproto_send(uint8_t type, uint8_t *payload, uint8_t len)
+{
+    uint8_t raw[1 + BINPROTO_TEXT_MAX + BINPROTO_CRC_LEN];
+    uint8_t buf[BINPROTO_MTU];
+
+    // 每个记录最多BINPROTO_MTU - BINPROTO_TEXT_MAX字节的开销（头字节、校验值、COBS开销和分隔符）
+    if (cdc_tx_space() < len + (1 + len / BINPROTO_TEXT_MAX) * (BINPROTO_MTU - BINPROTO_TEXT_MAX))
+    {
+        error_assert(ERR_USBTX_BUSY);
+        return;
+    }
+
+    do
+    {
+        uint8_t n = (len > BINPROTO_TEXT_MAX) ? BINPROTO_TEXT_MAX : len;
+
+        raw[0] = type;
+        for (uint8_t i = 0; i < n; i++)
+        {
+            raw[1 + i] = payload[i];
+        }
+        CDC_Transmit_FS(buf, binproto_seal(raw, 1 + n, buf));
+
+        payload += n;
+        len -= n;
+    } while (len > 0);
+}
+
+
+// 发送状态记录：错误寄存器、每个硬件FIFO的接收帧数和溢出次数、接收队列丢弃的帧数（均为小端32位）
+static void binproto_send_status(void)
+{
+    const can_rxstats_t *stats = can_get_rxstats();
+    uint8_t payload[6 * 4];
+    uint8_t *p = payload;
+
+    p = binproto_put32(p, error_reg());
+    p = binproto_put32(p, stats->frames[0]);
+    p = binproto_put32(p, stats->frames[1]);
+    p = binproto_put32(p, stats->overruns[0]);
+    p = binproto_put32(p, stats->overruns[1]);
+    p = binproto_put32(p, can_get_rxring()->overflows);
+
+    binproto_send(BINPROTO_TYPE_STATUS | BINPROTO_STATUS_STATS, payload, p - payload);
+}
+
+
+/**
+ * \brief 解析从主机收到的一个二进制记录（slcan_parse_str的二进制版本）。
+ *
+ * \param buf 收到的COBS编码记录，不含分隔符0x00。原地解码。
+ * \param len 编码记录的长度。
+ *
+ * \return 如果记录成功处理，则返回0。
+ *         如果编码、校验值或布局无效，则返回-1。
+ */
+int8_t binproto_parse_str(uint8_t *buf, uint8_t len)
+{
+    int16_t n = binproto_cobs_decode(buf, len);
+    if (n < 1 + BINPROTO_CRC_LEN)
+    {
+        return -1;
+    }
+
+    // 校验
+    n -= BINPROTO_CRC_LEN;
+    uint16_t crc = buf[n] | (buf[n + 1] << 8);
+    if (binproto_crc(buf, n) != crc)
+    {
+        return -1;
+    }
+
+    switch (buf[0] & BINPROTO_TYPE_MASK)
+    {
+        case BINPROTO_TYPE_TEXT:
+            // 封装的ASCII slcan命令
+            return slcan_parse_str(&buf[1], n - 1);
+
+        case BINPROTO_TYPE_STATUS:
+            binproto_send_status();
+            return 0;
+
+        case BINPROTO_TYPE_FRAME:
+            break;
+
+        default:
+            return -1;
+    }
+
+    // 发送CAN帧
+    CAN_TxHeaderTypeDef frame_header;
+    uint8_t pos = (buf[0] & BINPROTO_FLAG_EXT) ? 1 + 4 : 1 + 2;
+
+    frame_header.DLC = buf[0] & BINPROTO_DLC_MASK;
+    frame_header.RTR = (buf[0] & BINPROTO_FLAG_RTR) ? CAN_RTR_REMOTE : CAN_RTR_DATA;
+
+    // 读取ID之前先检查DLC和记录长度是否一致，发送确认打开时末尾可以附加1字节标签
+    uint8_t data_len = (frame_header.RTR == CAN_RTR_REMOTE) ? 0 : frame_header.DLC;
+    uint8_t tag = 0;
+    if (frame_header.DLC > 8)
+    {
+        return -1;
+    }
+    if (n == pos + data_len + 1 && can_get_txconf())
+    {
+        tag = buf[pos + data_len];
+    }
+    else if (n != pos + data_len)
+    {
+        return -1;
+    }
+
+    // 超出范围的ID在编码时会被截断成另一个ID，与slcan命令一样拒绝
+    frame_header.StdId = 0;
+    frame_header.ExtId = 0;
+    if (buf[0] & BINPROTO_FLAG_EXT)
+    {
+        frame_header.IDE = CAN_ID_EXT;
+        frame_header.ExtId = buf[1] | (buf[2] << 8) | (buf[3] << 16) | ((uint32_t)buf[4] << 24);
+        if (frame_header.ExtId > 0x1FFFFFFF)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        frame_header.IDE = CAN_ID_STD;
+        frame_header.StdId = buf[1] | (buf[2] << 8);
+        if (frame_header.StdId > 0x7FF)
+        {
+            return -1;
+        }
+    }
+
+    uint8_t frame_data[8] = {0};
+    for (uint8_t j = 0; j < data_len; j++)
+    {
+        frame_data[j] = buf[pos + j];
+    }
+
+    can_tx(&frame_header, frame_data, tag);
+
+    return 0;
+}
@@ -4,12 +4,33 @@
 // **2023.10.25
 //
 
+#include <stddef.h>
 #include "stm32f0xx_hal.h"
 #include "slcan.h"
 #include "usbd_cdc_if.h"
 #include "can.h"
 #include "led.h"
 #include "error.h"
+#include "filter.h"
+#include "event.h"
+
+
+// 位时序求解的范围：每位的时间量子数（同步段1 + TS1 1-16 + TS2 1-8），TS2至少2个时间量子（信息处理时间）
+#define CAN_TQ_MIN  8
+#define CAN_TQ_MAX  25
+#define CAN_TS1_MAX 16
+#define CAN_TS2_MIN 2
+#define CAN_TS2_MAX 8
+#define CAN_SJW_MAX 4
+#define CAN_BRP_MAX 1024
+
+// 接收时间戳：TIM2（32位）以1 MHz自由运行，队列中只保存低24位（约16.7 s回绕）
+#define CAN_TIMESTAMP_TIM  TIM2
+#define CAN_TIMESTAMP_MASK 0xFFFFFFUL
+
+// 队列中帧记录的附加字段（位于寄存器的保留位置，不写入硬件）：发送帧的主机标签、接收帧的到达时间
+#define CAN_TXFRAME_TAG_Pos  24
+#define CAN_RXFRAME_TIME_Pos 8
 
 
 // 静态变量
@@ -17,11 +38,15 @@
 // 定义CAN句柄结构体。此结构体通常包含了用于配置CAN模块的所有必要参数和配置设置。
 static CAN_HandleTypeDef can_handle;
 
-// 定义CAN滤波器结构体。此结构体是配置CAN硬件滤波器的必要组成部分，用于决定哪些传入的消息可被处理。
-static CAN_FilterTypeDef filter;
+// CAN位时序，BTR寄存器格式（BRP、TS1、TS2、SJW字段）。由比特率预设、位时序求解器或原始BTR值设置，
+// 在can_enable时写入外设。
+static uint32_t bit_timing;
 
-// 设置CAN总线速率的预分频值。这个值与微控制器的时钟速率有关，并用于计算位速率（例如，500 kbit/s）。
-static uint32_t prescaler;
+// 比特率预设（S命令），单位bit/s
+static const uint32_t bitrate_preset[CAN_BITRATE_INVALID] =
+{
+    10000, 20000, 50000, 100000, 125000, 250000, 500000, 750000, 1000000
+};
 
 // 这是表示CAN总线状态的枚举变量，初始设置为“OFF_BUS”（不在总线上），表示当前设备未连接到CAN总线。
 static can_bus_state_t bus_state = OFF_BUS;
@@ -29,13 +54,113 @@ static can_bus_state_t bus_state = OFF_BUS;
 // 自动重传使能标志。当设置为ENABLE时，如果消息在第一次尝试时没有成功发送，则硬件会自动重试发送。
 static uint8_t can_autoretransmit = ENABLE;
 
-// 定义一个发送缓冲区结构体（这里假设是一个队列），用于管理待发送的CAN消息。初始状态为空（所有元素为0）。
-static can_txbuf_t txqueue = {0};
+// 定义一个发送缓冲区结构体，用于管理待发送的CAN消息。槽位链表在can_init中初始化。
+static can_txbuf_t txqueue;
+
+// 发送顺序（enum can_tx_order）
+static uint8_t tx_order = CAN_TX_ORDER_FIFO;
+
+// 定义一个接收缓冲区结构体（环形队列）。由CAN接收中断生产，主循环消费。
+static can_rxbuf_t rxqueue = {.ring = RING_INIT(RXQUEUE_LEN)};
+_Static_assert(RING_SIZE_OK(RXQUEUE_LEN), "RXQUEUE_LEN must be a power of two");
+_Static_assert(offsetof(can_rxframe_t, rdhr) == offsetof(can_rxframe_t, rdlr) + 4, "can_rx() reads the data registers as one byte array");
+
+// 接收过载处理。丢失的帧由接收中断累计，在下一个写入队列的帧之前放入一个丢失标记槽位；
+// 主循环把标记和自己按最早丢弃策略丢弃的帧合并，在下一帧之前作为一条丢失记录发给主机。
+static volatile uint8_t rx_policy = CAN_RX_DROP_NEWEST;
+static uint32_t rx_lost = 0; // 接收中断：尚未写入队列的丢失帧数
+static uint32_t rx_lost_time = 0; // 接收中断：其中第一帧的到达时间（TIM2）
+static can_rxloss_t rx_loss = {0}; // 主循环：在下一帧之前报告的丢失
+static uint8_t rx_seq_enabled = 0; // 接收记录附加序号并报告丢失
+static uint16_t rx_seq = 0; // 主循环：下一条接收记录的序号，丢失的帧也占用序号
+
+// 发送确认：打开后每个发送帧的结果（连同主机提供的标签）由发送中断放入确认队列，主循环发给主机。
+static uint8_t can_txconf_enabled = 0;
+static can_txconfbuf_t txconf = {.ring = RING_INIT(TXCONF_LEN)};
+_Static_assert(RING_SIZE_OK(TXCONF_LEN), "TXCONF_LEN must be a power of two");
+static uint8_t mailbox_slot[3] = {TXQUEUE_NONE, TXQUEUE_NONE, TXQUEUE_NONE}; // 每个发送邮箱中的帧所在的发送队列槽位
+static uint8_t mailbox_preempt = 0; // 为让位给更高优先级的帧而请求中止的邮箱（位掩码）
+
+// Private function prototypes
+static void can_txqueue_link(uint8_t slot, uint8_t ahead);
+static void can_mailbox_done(uint8_t mailbox, uint8_t result);
+
+// 发送信用：打开后每释放一个发送队列槽位累计一个信用，由主循环分批返回给主机。
+// 主机只在持有信用时发送帧，因此发送队列永远不会溢出。
+static uint8_t can_credits_enabled = 0;
+static uint8_t tx_credits = 0;
+
+// 接收统计信息（每个硬件FIFO的帧数和溢出次数）。
+static can_rxstats_t rxstats = {0};
 
 // 接下来，您通常需要一个函数来初始化这些变量，设置CAN接口，配置滤波器，开启中断（如果使用），等等。
 // 请确保您的代码中有相应的初始化代码。
 
 
+// 位时序求解器：为给定的比特率和采样点（‰）计算BTR寄存器格式的位时序。
+// 在每位8-25个时间量子中搜索，比特率误差最小者优先，其次是采样点误差最小者，再次是时间量子数最多者。
+// 比特率误差超过0.5%时无解，返回HAL_ERROR且不修改btr。
+static HAL_StatusTypeDef can_solve_timing(uint32_t bitrate, uint32_t sample_point, uint32_t *btr)
+{
+    uint32_t clock = HAL_RCC_GetPCLK1Freq();
+    uint32_t best_rate_err = clock / 200 + 1;
+    uint32_t best_sp_err = 0;
+    HAL_StatusTypeDef status = HAL_ERROR;
+
+    if (bitrate == 0 || sample_point == 0 || sample_point >= 1000)
+    {
+        return HAL_ERROR;
+    }
+
+    for (uint32_t ntq = CAN_TQ_MAX; ntq >= CAN_TQ_MIN; ntq--)
+    {
+        // 四舍五入得到预分频值
+        uint32_t brp = (clock + bitrate * ntq / 2) / (bitrate * ntq);
+        if (brp < 1 || brp > CAN_BRP_MAX)
+        {
+            continue;
+        }
+
+        // 比特率误差，以时钟周期计
+        uint32_t actual = brp * ntq * bitrate;
+        uint32_t rate_err = (actual > clock) ? actual - clock : clock - actual;
+
+        // 采样点位于同步段（1个时间量子）和TS1之后
+        uint32_t ts1 = (ntq * sample_point + 500) / 1000;
+        ts1 = (ts1 > 1) ? ts1 - 1 : 1;
+        if (ts1 > CAN_TS1_MAX)
+        {
+            ts1 = CAN_TS1_MAX;
+        }
+        if (ntq - 1 - ts1 < CAN_TS2_MIN)
+        {
+            ts1 = ntq - 1 - CAN_TS2_MIN;
+        }
+        if (ntq - 1 - ts1 > CAN_TS2_MAX)
+        {
+            ts1 = ntq - 1 - CAN_TS2_MAX;
+        }
+        uint32_t ts2 = ntq - 1 - ts1;
+
+        uint32_t sp = (1 + ts1) * 1000 / ntq;
+        uint32_t sp_err = (sp > sample_point) ? sp - sample_point : sample_point - sp;
+
+        if (rate_err < best_rate_err || (rate_err == best_rate_err && sp_err < best_sp_err))
+        {
+            uint32_t sjw = (ts2 < CAN_SJW_MAX) ? ts2 : CAN_SJW_MAX;
+
+            best_rate_err = rate_err;
+            best_sp_err = sp_err;
+            *btr = ((brp - 1) << CAN_BTR_BRP_Pos) | ((ts1 - 1) << CAN_BTR_TS1_Pos) |
+                   ((ts2 - 1) << CAN_BTR_TS2_Pos) | ((sjw - 1) << CAN_BTR_SJW_Pos);
+            status = HAL_OK;
+        }
+    }
+
+    return status;
+}
+
+
 /**
  * \brief 初始化CAN外设，但不实际启动外设。
  *
@@ -65,23 +190,31 @@ void can_init(void)
     GPIO_InitStruct.Alternate = GPIO_AF4_CAN; // 设置复用功能为CAN
     HAL_GPIO_Init(GPIOB, &GPIO_InitStruct); // 应用以上设置初始化GPIO
 
-    // 初始化默认CAN滤波器配置
-    // 这里的设置决定了哪些类型的消息将被硬件接受
-    filter.FilterIdHigh = 0x0000;
-    filter.FilterIdLow = 0x0000;
-    filter.FilterMaskIdHigh = 0x0000;
-    filter.FilterMaskIdLow = 0x0000;
-    filter.FilterFIFOAssignment = CAN_RX_FIFO0; // 指定接收到的消息存储到FIFO 0
-    filter.FilterBank = 0; // 使用过滤器组0
-    filter.FilterMode = CAN_FILTERMODE_IDMASK; // 设置过滤器模式为标识符掩码模式
-    filter.FilterScale = CAN_FILTERSCALE_32BIT; // 设置过滤器配置为32位
-    filter.FilterActivation = ENABLE; // 激活过滤器
+    // 配置过滤器组：复位后所有过滤器组都未激活，不会接收任何帧
+    filter_apply();
+
+    // 所有发送队列槽位进入空闲链表
+    for (uint8_t i = 0; i < TXQUEUE_LEN; i++)
+    {
+        txqueue.next[i] = i + 1;
+    }
+    txqueue.next[TXQUEUE_LEN - 1] = TXQUEUE_NONE;
+    txqueue.free = 0;
+    txqueue.head = TXQUEUE_NONE;
+    txqueue.tail = TXQUEUE_NONE;
 
     // 默认情况下，将通信速率设置为125 kbit/s
-    prescaler = 48; // 此预分频值与微控制器的时钟系统有关
+    can_solve_timing(bitrate_preset[CAN_BITRATE_125K], CAN_SAMPLE_POINT_DEFAULT, &bit_timing);
     can_handle.Instance = CAN; // 指定CAN实例
     bus_state = OFF_BUS; // 当前CAN总线的状态为未连接
 
+    // 启动微秒时间戳计数器：TIM2时钟为PCLK（APB不分频），分频到1 MHz，32位自由运行
+    __HAL_RCC_TIM2_CLK_ENABLE();
+    CAN_TIMESTAMP_TIM->PSC = HAL_RCC_GetPCLK1Freq() / 1000000 - 1;
+    CAN_TIMESTAMP_TIM->ARR = 0xFFFFFFFF;
+    CAN_TIMESTAMP_TIM->EGR = TIM_EGR_UG; // 立即装载预分频值
+    CAN_TIMESTAMP_TIM->CR1 = TIM_CR1_CEN;
+
     // 设置中断并激活
     HAL_NVIC_SetPriority(CEC_CAN_IRQn, 1, 0); // 设置中断优先级
     HAL_NVIC_EnableIRQ(CEC_CAN_IRQn); // 启用中断请求
@@ -91,7 +224,7 @@ void can_init(void)
 /**
  * \brief 启动CAN外设并改变总线状态。
  *
- * 如果CAN总线当前处于非活动状态，此函数将初始化CAN总线参数，配置过滤器，
+ * 如果CAN总线当前处于非活动状态，此函数将初始化CAN总线参数（过滤器组在can_init和过滤器集合改变时配置），
  * 并正式启动CAN总线通信。此外，一旦通信开始，它还会通过点亮蓝色LED来指示总线活动状态。
  *
  * \param void 该函数不需要外部参数，因为它使用的是内部静态变量和之前通过`can_init`函数设置的值。
@@ -105,13 +238,13 @@ void can_enable(void)
     if (bus_state == OFF_BUS) // 如果当前状态是已断开的
     {
         // 配置CAN总线参数
-        can_handle.Init.Prescaler = prescaler; // 设置时钟预分频器的值
+        can_handle.Init.Prescaler = (bit_timing & CAN_BTR_BRP) + 1; // 设置时钟预分频器的值
         can_handle.Init.Mode = CAN_MODE_NORMAL; // 设置工作模式为正常模式，非环回或静默模式
 
-        // 设置CAN总线定时参数
-        can_handle.Init.SyncJumpWidth = CAN_SJW_1TQ; // 同步跳跃宽度为1时间量化单位
-        can_handle.Init.TimeSeg1 = CAN_BS1_4TQ; // 时间段1为4时间量化单位
-        can_handle.Init.TimeSeg2 = CAN_BS2_3TQ; // 时间段2为3时间量化单位
+        // 设置CAN总线定时参数（HAL的取值与BTR寄存器的字段位置相同）
+        can_handle.Init.SyncJumpWidth = bit_timing & CAN_BTR_SJW; // 同步跳跃宽度
+        can_handle.Init.TimeSeg1 = bit_timing & CAN_BTR_TS1; // 时间段1
+        can_handle.Init.TimeSeg2 = bit_timing & CAN_BTR_TS2; // 时间段2
 
         // 禁用触发模式，因为我们不需要基于时间的触发发送操作
         can_handle.Init.TimeTriggeredMode = DISABLE;
@@ -128,18 +261,27 @@ void can_enable(void)
         // 不锁定接收FIFO，新的覆盖旧的
         can_handle.Init.ReceiveFifoLocked = DISABLE;
 
-        // 启用传输FIFO的优先级管理，有更高优先级的消息将会先发送
-        can_handle.Init.TransmitFifoPriority = ENABLE;
+        // FIFO顺序下邮箱按装入顺序发送；优先级顺序下邮箱按ID优先级发送
+        can_handle.Init.TransmitFifoPriority = (tx_order == CAN_TX_ORDER_PRIORITY) ? DISABLE : ENABLE;
 
         // 用以上参数初始化CAN
         HAL_CAN_Init(&can_handle);
 
-        // 应用之前在`can_init`中设置的过滤器配置
-        HAL_CAN_ConfigFilter(&can_handle, &filter);
+        // 清空软件接收队列，丢弃上次打开通道时残留的帧，序号从0开始
+        ring_release(&rxqueue.ring, ring_used(&rxqueue.ring));
+        rx_lost = 0;
+        rx_loss.count = 0;
+        rx_seq = 0;
 
         // 正式启动CAN外设通信
         HAL_CAN_Start(&can_handle);
 
+        // 开启两个FIFO的消息挂起中断和溢出中断，由中断将帧搬入软件接收队列
+        // 同时开启发送邮箱空中断，用于报告每个发送帧的结果，并在中断中立即装入下一帧（见can_tx_refill）
+        HAL_CAN_ActivateNotification(&can_handle, CAN_IT_RX_FIFO0_MSG_PENDING | CAN_IT_RX_FIFO0_OVERRUN |
+                                                  CAN_IT_RX_FIFO1_MSG_PENDING | CAN_IT_RX_FIFO1_OVERRUN |
+                                                  CAN_IT_TX_MAILBOX_EMPTY);
+
         // 更改状态以反映CAN总线现在是活动的
         bus_state = ON_BUS;
 
@@ -168,6 +310,15 @@ void can_disable(void)
         // 执行bxCAN复位操作，将复位位设置为1
     	can_handle.Instance->MCR |= CAN_MCR_RESET;
 
+        // 复位清空了发送邮箱且不会产生中断：邮箱中的帧报告为已中止并释放槽位
+        __disable_irq();
+        mailbox_preempt = 0;
+        for (uint8_t mailbox = 0; mailbox < 3; mailbox++)
+        {
+            can_mailbox_done(mailbox, CAN_TXCONF_ABORTED);
+        }
+        __enable_irq();
+
         // 更改内部状态以反映CAN总线现在是非活动的
         bus_state = OFF_BUS;
 
@@ -181,66 +332,81 @@ void can_disable(void)
  * \brief 设置CAN外设的比特率。
  *
  * 该函数根据指定的比特率设置CAN总线的通信速度。它先检查总线是否处于非活动状态，
- * 因为无法在连接状态下更改比特率。然后，它根据枚举参数`bitrate`设置预分频器的值。
- * 最后，通过点亮绿色LED指示比特率已更改。
+ * 因为无法在连接状态下更改比特率。然后，它用位时序求解器为预设比特率计算位时序，
+ * 采样点为CAN_SAMPLE_POINT_DEFAULT。最后，通过点亮绿色LED指示比特率已更改。
  *
  * \param bitrate 可以是以下枚举值之一，指定所需的通信速度：
  *        CAN_BITRATE_10K, CAN_BITRATE_20K, CAN_BITRATE_50K, 
  *        CAN_BITRATE_100K, CAN_BITRATE_125K, CAN_BITRATE_250K, 
- *        CAN_BITRATE_500K, CAN_BITRATE_750K, CAN_BITRATE_1000K,
- *        或 CAN_BITRATE_INVALID 用于无效的比特率。
+ *        CAN_BITRATE_500K, CAN_BITRATE_750K, CAN_BITRATE_1000K。
+ *        CAN_BITRATE_INVALID或其他值将被忽略。
  *
- * \return 无返回值。如果总线处于活动状态，函数将不执行任何操作。否则，它将更改预分频器的值，
- *         从而影响下一次启动总线时使用的比特率。函数不直接报告是否成功应用了新比特率。
+ * \return 无返回值。如果总线处于活动状态，函数将不执行任何操作。否则，它将更改位时序，
+ *         从而影响下一次启动总线时使用的比特率。
  */
 void can_set_bitrate(enum can_bitrate bitrate)
+{
+    // 对于无效的比特率不做改变
+    if (bitrate >= CAN_BITRATE_INVALID)
+    {
+        return;
+    }
+
+    can_set_bittiming(bitrate_preset[bitrate], CAN_SAMPLE_POINT_DEFAULT);
+}
+
+
+/**
+ * \brief 按比特率和采样点设置位时序。
+ *
+ * 位时序求解器根据当前的外设时钟（PCLK，HSI48或外部晶振构建都适用）选择预分频器、TS1、TS2和SJW，
+ * 因此可以设置33.3k、83.3k等任意比特率。
+ *
+ * \param bitrate 比特率，单位bit/s。
+ * \param sample_point 采样点，单位‰（例如875表示87.5%）。
+ *
+ * \return HAL_OK：位时序已设置，下一次启动总线时生效。
+ *         HAL_BUSY：总线处于活动状态，不做改变。
+ *         HAL_ERROR：无法在0.5%的误差内得到该比特率，不做改变。
+ */
+HAL_StatusTypeDef can_set_bittiming(uint32_t bitrate, uint32_t sample_point)
 {
     // 检查当前的总线状态，只有在总线未激活时才能设置比特率
     if (bus_state == ON_BUS)
     {
-        // 如果尝试在总线活动时更改比特率，则直接返回
-        return;
+        return HAL_BUSY;
     }
 
-    // 根据输入的比特率设置对应的预分频值
-    switch (bitrate)
+    if (can_solve_timing(bitrate, sample_point, &bit_timing) != HAL_OK)
     {
-        case CAN_BITRATE_10K:
-        	prescaler = 600; // 对应10K比特率
-            break;
-        case CAN_BITRATE_20K:
-        	prescaler = 300; // 对应20K比特率
-            break;
-        case CAN_BITRATE_50K:
-        	prescaler = 120; // 对应50K比特率
-            break;
-        case CAN_BITRATE_100K:
-            prescaler = 60; // 对应100K比特率
-            break;
-        case CAN_BITRATE_125K:
-            prescaler = 48; // 对应125K比特率
-            break;
-        case CAN_BITRATE_250K:
-            prescaler = 24; // 对应250K比特率
-            break;
-        case CAN_BITRATE_500K:
-            prescaler = 12; // 对应500K比特率
-            break;
-        case CAN_BITRATE_750K:
-            prescaler = 8; // 对应750K比特率
-            break;
-        case CAN_BITRATE_1000K:
-            prescaler = 6; // 对应1000K比特率
-            break;
-        case CAN_BITRATE_INVALID:
-        default:
-            // 对于无效的比特率或未处理的情况，设置一个默认值
-            prescaler = 6; // 可以视情况更改为安全或合理的值
-            break;
+        return HAL_ERROR;
     }
 
     // 操作完成后点亮绿色LED，作为物理指示
     led_green_on();
+    return HAL_OK;
+}
+
+
+/**
+ * \brief 直接设置BTR寄存器的位时序字段（BRP、TS1、TS2、SJW）。
+ *
+ * \param btr BTR寄存器值。模式位（LBKM、SILM）被忽略。
+ *
+ * \return HAL_OK：位时序已设置，下一次启动总线时生效。
+ *         HAL_BUSY：总线处于活动状态，不做改变。
+ */
+HAL_StatusTypeDef can_set_btr(uint32_t btr)
+{
+    if (bus_state == ON_BUS)
+    {
+        return HAL_BUSY;
+    }
+
+    bit_timing = btr & CAN_BTR_TIMING_MASK;
+
+    led_green_on();
+    return HAL_OK;
 }
 
 
@@ -323,44 +489,424 @@ void can_set_autoretransmit(uint8_t autoretransmit)
 }
 
 
+/**
+ * \brief 设置接收FIFO分流模式。
+ *
+ * 在单FIFO模式下所有帧都进入FIFO 0，只能利用3个硬件槽位。分流模式把接受的ID分配到两个FIFO，
+ * 使硬件能够吸收的突发长度加倍。可按ID奇偶分流（连续ID的突发被均匀分配），或按ID最高位分流
+ * （高优先级的低ID进入FIFO 0）。与其他配置一样，只能在总线关闭时设置，在下一次打开通道时生效。
+ *
+ * \param mode 分流模式，见enum can_fifo_mode。
+ */
+void can_set_fifo_mode(enum can_fifo_mode mode)
+{
+    // 总线活动时不能更改过滤器配置
+    if (bus_state == ON_BUS || mode >= CAN_FIFO_MODE_INVALID)
+    {
+        return;
+    }
+
+    filter_set_fifo_mode(mode);
+
+    // 操作完成后点亮绿色LED，作为物理指示
+    led_green_on();
+}
+
+
+/**
+ * \brief 设置发送顺序。只能在通道关闭时设置，已在队列中的帧按新的顺序重新排列。
+ *
+ * \param order 发送顺序，见enum can_tx_order。
+ *
+ * \return HAL_OK；通道打开时返回HAL_BUSY；顺序无效时返回HAL_ERROR。
+ */
+HAL_StatusTypeDef can_set_tx_order(enum can_tx_order order)
+{
+    if (bus_state == ON_BUS)
+    {
+        return HAL_BUSY;
+    }
+    if (order >= CAN_TX_ORDER_INVALID)
+    {
+        return HAL_ERROR;
+    }
+
+    __disable_irq();
+    tx_order = order;
+    uint8_t slot = txqueue.head;
+    txqueue.head = TXQUEUE_NONE;
+    txqueue.tail = TXQUEUE_NONE;
+    while (slot != TXQUEUE_NONE)
+    {
+        uint8_t next = txqueue.next[slot];
+        can_txqueue_link(slot, 0);
+        slot = next;
+    }
+    __enable_irq();
+
+    return HAL_OK;
+}
+
+
+// 记录一个发送结果。在发送中断中调用，或由主循环在关中断时调用（二者不会同时生产）。
+static void can_txconf_put(uint8_t tag, uint8_t result)
+{
+    if (!can_txconf_enabled)
+    {
+        return;
+    }
+    if (!ring_claim(&txconf.ring, 1))
+    {
+        error_assert(ERR_FULLBUF_TXCONF);
+        return;
+    }
+
+    can_txconf_t *conf = &txconf.conf[RING_HEAD(&txconf.ring)];
+    conf->tag = tag;
+    conf->result = result;
+    ring_publish(&txconf.ring, 1);
+}
+
+
+// 把槽位链入等待发送的链表。FIFO顺序追加到末尾；优先级顺序插入到优先级更低的帧之前（TIR数值更大，
+// TIR的布局与总线仲裁顺序一致：先比较11位基本ID，同一基本ID的标准帧优先于扩展帧，最后数据帧优先于远程帧），
+// ahead为1时还插入到同一ID的帧之前（被抢占后重新排队的帧比它们先到）。调用者须关中断。
+static void can_txqueue_link(uint8_t slot, uint8_t ahead)
+{
+    uint8_t prev = txqueue.tail;
+    uint8_t cur = TXQUEUE_NONE;
+
+    if (tx_order == CAN_TX_ORDER_PRIORITY)
+    {
+        uint32_t key = txqueue.frame[slot].tir;
+
+        prev = TXQUEUE_NONE;
+        cur = txqueue.head;
+        while (cur != TXQUEUE_NONE)
+        {
+            uint32_t cur_key = txqueue.frame[cur].tir;
+            if (cur_key > key || (ahead && cur_key == key))
+            {
+                break;
+            }
+            prev = cur;
+            cur = txqueue.next[cur];
+        }
+    }
+
+    txqueue.next[slot] = cur;
+    if (prev == TXQUEUE_NONE)
+    {
+        txqueue.head = slot;
+    }
+    else
+    {
+        txqueue.next[prev] = slot;
+    }
+    if (cur == TXQUEUE_NONE)
+    {
+        txqueue.tail = slot;
+    }
+}
+
+
+// 释放槽位，报告发送结果并为主机累计一个信用。在发送中断中调用，或由主循环在关中断时调用。
+static void can_txqueue_release(uint8_t slot, uint8_t result)
+{
+    can_txconf_put(txqueue.frame[slot].tdtr >> CAN_TXFRAME_TAG_Pos, result);
+
+    txqueue.next[slot] = txqueue.free;
+    txqueue.free = slot;
+    txqueue.count--;
+
+    if (can_credits_enabled)
+    {
+        tx_credits++;
+    }
+
+    // 主循环报告发送结果和信用
+    event_post(EVENT_CAN_TX);
+}
+
+
+// 邮箱中的帧已结束（发送成功、失败或中止）。被抢占的帧重新排队，其他帧释放槽位。
+// 在发送中断中调用，或由主循环在关中断时调用。
+static void can_mailbox_done(uint8_t mailbox, uint8_t result)
+{
+    uint8_t slot = mailbox_slot[mailbox];
+
+    if (slot == TXQUEUE_NONE)
+    {
+        return;
+    }
+    mailbox_slot[mailbox] = TXQUEUE_NONE;
+
+    if (result == CAN_TXCONF_ABORTED && (mailbox_preempt & (1 << mailbox)))
+    {
+        can_txqueue_link(slot, 1);
+    }
+    else
+    {
+        can_txqueue_release(slot, result);
+    }
+    mailbox_preempt &= ~(1 << mailbox);
+}
+
+
+// 邮箱中是否已有与key相同ID的帧。优先级顺序下硬件对相同ID按邮箱编号而不是装入顺序发送，
+// 所以同一ID的下一帧要等前一帧离开邮箱后才能装入。
+static uint8_t can_mailbox_holds(uint32_t key)
+{
+    for (uint8_t mailbox = 0; mailbox < 3; mailbox++)
+    {
+        if (mailbox_slot[mailbox] != TXQUEUE_NONE && txqueue.frame[mailbox_slot[mailbox]].tir == key)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// 优先级顺序下，三个邮箱都被占用且队首的帧比邮箱中优先级最低的帧更紧急时，中止该邮箱。
+// 被中止的帧在中止回调中重新排队；如果它已经在发送，中止无效，帧正常完成。一次只抢占一个邮箱。
+// 调用者须关中断，或在CAN中断中调用。
+static void can_preempt(void)
+{
+    if (tx_order != CAN_TX_ORDER_PRIORITY || mailbox_preempt != 0 || txqueue.head == TXQUEUE_NONE)
+    {
+        return;
+    }
+
+    uint32_t victim_key = txqueue.frame[txqueue.head].tir;
+    int8_t victim = -1;
+
+    for (uint8_t mailbox = 0; mailbox < 3; mailbox++)
+    {
+        uint8_t slot = mailbox_slot[mailbox];
+        if (slot == TXQUEUE_NONE)
+        {
+            // 还有空闲邮箱，不需要抢占
+            return;
+        }
+        if (txqueue.frame[slot].tir > victim_key)
+        {
+            victim_key = txqueue.frame[slot].tir;
+            victim = mailbox;
+        }
+    }
+
+    if (victim >= 0)
+    {
+        // 只写ABRQ位：TSR中的完成标志是写1清除的，读-改-写会误清除其他邮箱的完成标志
+        mailbox_preempt = 1 << victim;
+        can_handle.Instance->TSR = CAN_TSR_ABRQ0 << (8 * victim);
+    }
+}
+
+
+/**
+ * \brief 把等待发送的帧装入所有空闲的发送邮箱，然后在需要时抢占邮箱。
+ *
+ * 由主循环（can_process）在关中断时调用，也在每次CAN中断结束时调用（can_tx_refill），
+ * 因此邮箱一空出来就立即装入下一帧，总线上的连续发送不依赖主循环的速度。
+ * 帧记录已经是邮箱寄存器格式，直接写入寄存器，不经过HAL_CAN_AddTxMessage的状态检查和编码。
+ * 装入失败（通道未打开）的帧释放槽位并报告为错误。
+ *
+ * \return 装入邮箱或因失败而释放的帧数。
+ */
+static uint8_t can_tx_load(void)
+{
+    uint8_t loaded = 0;
+    uint32_t tsr;
+
+    while (txqueue.head != TXQUEUE_NONE && ((tsr = can_handle.Instance->TSR) & CAN_TSR_TME))
+    {
+        uint8_t slot = txqueue.head;
+        can_txframe_t *frame = &txqueue.frame[slot];
+
+        // 优先级顺序下同一ID的前一帧还在邮箱中时，等它离开邮箱后再装入
+        if (tx_order == CAN_TX_ORDER_PRIORITY && can_mailbox_holds(frame->tir))
+        {
+            break;
+        }
+
+        // 从队列中取出一条消息
+        txqueue.head = txqueue.next[slot];
+        if (txqueue.head == TXQUEUE_NONE)
+        {
+            txqueue.tail = TXQUEUE_NONE;
+        }
+
+        if (bus_state == ON_BUS)
+        {
+            // TSR的CODE字段给出下一个空闲邮箱。槽位必须在邮箱可能完成（发送中断）之前记录，
+            // 帧记录已经是寄存器格式，最后写入TIR并置位TXRQ请求发送
+            uint32_t mailbox = (tsr & CAN_TSR_CODE) >> CAN_TSR_CODE_Pos;
+            CAN_TxMailBox_TypeDef *regs = &can_handle.Instance->sTxMailBox[mailbox];
+
+            mailbox_slot[mailbox] = slot;
+            regs->TDTR = frame->tdtr & CAN_TDT0R_DLC;
+            regs->TDLR = frame->tdlr;
+            regs->TDHR = frame->tdhr;
+            regs->TIR = frame->tir | CAN_TI0R_TXRQ;
+        }
+        else
+        {
+            // 通道未打开时无法发送：释放槽位并向主机报告。注意，失败的消息不会被重新发送
+            can_txqueue_release(slot, CAN_TXCONF_ERROR);
+            error_assert(ERR_CAN_TXFAIL);
+        }
+        loaded++;
+    }
+
+    // 优先级顺序下让紧急的帧抢占低优先级帧占用的邮箱
+    can_preempt();
+
+    return loaded;
+}
+
+
+// 在CAN中断处理结束时调用：HAL的邮箱回调都已执行完，把等待发送的帧装入空出的邮箱。
+// 不能在邮箱回调中装入，因为HAL随后还会按中断开始时读取的TSR处理其他邮箱的完成标志。
+void can_tx_refill(void)
+{
+    if (txqueue.head != TXQUEUE_NONE)
+    {
+        can_tx_load();
+    }
+}
+
+
+// 打开或关闭发送确认（enable为1时打开）
+void can_set_txconf(uint8_t enable)
+{
+    can_txconf_enabled = enable;
+}
+
+
+// 发送确认是否打开
+uint8_t can_get_txconf(void)
+{
+    return can_txconf_enabled;
+}
+
+
+/**
+ * \brief 打开或关闭基于信用的发送流控。
+ *
+ * 打开时，当前空闲的发送队列槽位数作为初始信用，立即返回给主机。之后每个结束发送（离开邮箱）的帧
+ * 都返回一个信用。主机每发送一帧消耗一个信用。
+ *
+ * \param enable 1为打开，0为关闭。
+ */
+void can_set_credits(uint8_t enable)
+{
+    __disable_irq();
+    can_credits_enabled = enable;
+    tx_credits = enable ? TXQUEUE_LEN - txqueue.count : 0;
+    __enable_irq();
+}
+
+
+// 应当返回给主机的信用数：累计满TXCREDIT_BATCH个，或所有帧都已离开设备时返回全部累计的信用，否则为0
+uint8_t can_credits_due(void)
+{
+    if (tx_credits >= TXCREDIT_BATCH || txqueue.count == 0)
+    {
+        return tx_credits;
+    }
+    return 0;
+}
+
+
+// 信用已经成功交给USB发送，从累计值中扣除。发送失败时信用保留到下一次。
+void can_credits_sent(uint8_t credits)
+{
+    __disable_irq();
+    tx_credits -= credits;
+    __enable_irq();
+}
+
+
+/**
+ * \brief 从确认队列中取出一个发送结果。
+ *
+ * \param conf 指向can_txconf_t结构的指针，用于存储标签和发送结果。
+ *
+ * \return 如果取出了一个发送结果，返回HAL_OK；队列为空时返回HAL_ERROR。
+ */
+uint32_t can_txconf_rx(can_txconf_t *conf)
+{
+    if (ring_used(&txconf.ring) == 0)
+    {
+        return HAL_ERROR;
+    }
+
+    *conf = txconf.conf[RING_TAIL(&txconf.ring)];
+    ring_release(&txconf.ring, 1);
+
+    return HAL_OK;
+}
+
+
 /**
  * \brief 在CAN总线上发送消息。
  *
  * 此函数将用户定义的消息放入传输队列中，准备通过CAN总线发送。
  * 它首先检查发送缓冲区是否有可用空间，并在没有时返回错误。
- * 如果有可用空间，它会将传输消息头和数据复制到队列中，并更新队列的头指针。
+ * 如果有可用空间，它会把消息头和数据编码为邮箱寄存器格式（TIR/TDTR/TDLR/TDHR）存入队列。
  * 需要注意的是，此函数并不立即发送消息；它只是将消息排队等待发送。
  *
  * \param tx_msg_header 指向CAN_TxHeaderTypeDef结构的指针，该结构包含了要发送的消息的定义信息，
  *        例如消息ID、RTR（远程传输请求）状态、DLC（数据长度代码）等。
  *
- * \param tx_msg_data 指向包含要发送数据的数组的指针。数据的长度应该与tx_msg_header中的DLC匹配。
+ * \param tx_msg_data 指向包含要发送数据的8字节数组的指针。只有前DLC个字节会被发送。
+ *
+ * \param tag 主机提供的标签，发送确认打开时随帧的发送结果一起报告。
  *
  * \return 函数返回一个uint32_t值，指示消息是否已成功排队。
  *         - 如果消息成功排队，函数返回HAL_OK。
  *         - 如果发送缓冲区已满，函数会触发一个ERR_FULLBUF_CANTX错误，并返回HAL_ERROR。
  */
-uint32_t can_tx(CAN_TxHeaderTypeDef *tx_msg_header, uint8_t* tx_msg_data)
+uint32_t can_tx(CAN_TxHeaderTypeDef *tx_msg_header, uint8_t* tx_msg_data, uint8_t tag)
 {
-	// 检查缓冲区中是否有可用空间。注意：当前的实现会浪费一个缓冲区项
-	if( ((txqueue.head + 1) % TXQUEUE_LEN) == txqueue.tail)
+	// 检查缓冲区中是否有空闲槽位（邮箱中尚未结束的帧也占用槽位）
+	if (txqueue.count >= TXQUEUE_LEN)
 	{
 		// 如果没有可用空间，触发一个满缓冲区错误，并返回HAL_ERROR
 		error_assert(ERR_FULLBUF_CANTX);
 		return HAL_ERROR;
 	}
 
-	// 将用户提供的消息头复制到发送队列中
-	txqueue.header[txqueue.head] = *tx_msg_header;
+	// 从空闲链表取出一个槽位（发送中断会释放槽位）
+	__disable_irq();
+	uint8_t slot = txqueue.free;
+	txqueue.free = txqueue.next[slot];
+	txqueue.count++;
+	__enable_irq();
 
-	// 根据消息头中的DLC，将用户提供的数据复制到发送队列中
-	for(uint8_t i=0; i<tx_msg_header->DLC; i++)
+	// 编码为邮箱寄存器格式，装入邮箱时只需写4个字
+	can_txframe_t *frame = &txqueue.frame[slot];
+	if (tx_msg_header->IDE == CAN_ID_EXT)
 	{
-		txqueue.data[txqueue.head][i] = tx_msg_data[i];
+		frame->tir = (tx_msg_header->ExtId << CAN_TI0R_EXID_Pos) | CAN_ID_EXT;
 	}
+	else
+	{
+		frame->tir = tx_msg_header->StdId << CAN_TI0R_STID_Pos;
+	}
+	frame->tir |= tx_msg_header->RTR;
+	frame->tdtr = (tx_msg_header->DLC & CAN_TDT0R_DLC) | ((uint32_t)tag << CAN_TXFRAME_TAG_Pos);
+
+	// 数据按小端装入两个数据寄存器（调用者提供完整的8字节缓冲区，超出DLC的字节不会被发送）
+	frame->tdlr = tx_msg_data[0] | (tx_msg_data[1] << 8) | (tx_msg_data[2] << 16) | ((uint32_t)tx_msg_data[3] << 24);
+	frame->tdhr = tx_msg_data[4] | (tx_msg_data[5] << 8) | (tx_msg_data[6] << 16) | ((uint32_t)tx_msg_data[7] << 24);
 
-	// 更新发送队列的头指针，以准备下一条消息
-	txqueue.head = (txqueue.head + 1) % TXQUEUE_LEN;
+	// 按发送顺序链入等待发送的链表
+	__disable_irq();
+	can_txqueue_link(slot, 0);
+	__enable_irq();
 
 	// 消息已成功排队，返回HAL_OK
 	return HAL_OK;
@@ -371,9 +917,9 @@ uint32_t can_tx(CAN_TxHeaderTypeDef *tx_msg_header, uint8_t* tx_msg_data)
  * \brief 处理在TX输出队列中的消息。
  *
  * 此函数负责处理在传输队列中等待的CAN消息。当传输邮箱可用时，
- * 它会自动从队列中发送消息。这个过程继续，直到队列为空或没有更多的
- * 可用传输邮箱为止。如果发送过程中出现错误，该函数将不会重试传输，
- * 而是断言一个错误。
+ * 它会把队列中的帧装入所有空闲的邮箱，直到队列为空或没有更多的
+ * 可用传输邮箱为止。邮箱空出后，发送中断会立即装入下一帧（见can_tx_refill），
+ * 这里只负责启动发送（例如队列原本为空时）。帧的槽位在帧离开邮箱时（发送中断）释放。
  *
  * \note 这个函数不处理接收到的CAN消息，也不执行任何关于消息处理的高级逻辑。
  * 它仅仅是从队列中发送消息，并处理与硬件传输过程相关的错误。
@@ -383,71 +929,220 @@ uint32_t can_tx(CAN_TxHeaderTypeDef *tx_msg_header, uint8_t* tx_msg_data)
  */
 void can_process(void)
 {
-    // 如果发送队列不为空，且有可用的传输邮箱（硬件资源），则准备发送消息
-    if((txqueue.tail != txqueue.head) && (HAL_CAN_GetTxMailboxesFreeLevel(&can_handle) > 0))
-	{
-		// 尝试在CAN总线上发送帧
-		uint32_t mailbox_txed = 0; // 将被设置为用于当前传输的邮箱的标识符
-		// 从队列中获取一条消息，并尝试通过可用的邮箱发送它
-		uint32_t status = HAL_CAN_AddTxMessage(&can_handle, &txqueue.header[txqueue.tail], txqueue.data[txqueue.tail], &mailbox_txed);
-		// 无论传输是否成功，都将队列尾指针移动到下一条消息
-		txqueue.tail = (txqueue.tail + 1) % TXQUEUE_LEN;
-
-		led_green_on(); // 可能是指示消息已被放入传输邮箱的信号
-
-		// 如果消息传输失败（非常不太可能，因为我们之前检查了邮箱的可用性），记录一个错误
-		if(status != HAL_OK)
-		{
-			// 断言一个传输失败错误，注意，失败的消息不会被重新发送
-			error_assert(ERR_CAN_TXFAIL);
-		}
-	}
+    // 如果有等待发送的帧，则装入空闲的邮箱；槽位链表和确认队列只在关中断时由主循环修改
+    if (txqueue.head != TXQUEUE_NONE)
+    {
+        __disable_irq();
+        uint8_t loaded = can_tx_load();
+        __enable_irq();
+
+        if (loaded)
+        {
+            led_green_on(); // 指示消息已被放入传输邮箱
+        }
+    }
+}
+
+
+// 还原32位到达时间：队列中保存的是TIM2的低24位，帧到达时间早于当前时间，二者之差不超过24位
+static uint32_t can_rx_time(uint32_t rdtr)
+{
+    uint32_t now = CAN_TIMESTAMP_TIM->CNT;
+    return now - ((now - (rdtr >> CAN_RXFRAME_TIME_Pos)) & CAN_TIMESTAMP_MASK);
+}
+
+
+// 把一个丢失的帧计入主循环的丢失记录
+static void can_rx_loss_add(uint32_t count, uint32_t time)
+{
+    if (rx_loss.count == 0)
+    {
+        rx_loss.time = time;
+        rx_loss.seq = rx_seq;
+    }
+    rx_loss.count += count;
+}
+
+
+// 取出队列尾部的丢失标记，合并到丢失记录中。返回1表示尾部是一个帧，0表示队列为空
+static uint8_t can_rx_absorb(void)
+{
+    while (ring_used(&rxqueue.ring))
+    {
+        can_rxframe_t *frame = &rxqueue.frame[RING_TAIL(&rxqueue.ring)];
+        if (!(frame->rir & CAN_RXFRAME_LOSS))
+        {
+            return 1;
+        }
+
+        can_rx_loss_add(frame->rdlr, can_rx_time(frame->rdtr));
+        ring_release(&rxqueue.ring, 1);
+    }
+    return 0;
 }
 
 
 /**
- * \brief 从CAN总线的RXFIFO接收消息。
+ * \brief 读取软件接收队列中最早的一条消息，不复制数据。
  * 
- * 此函数从CAN硬件的接收FIFO队列中提取一条消息。如果成功，消息的头和数据将被存储在提供的参数中。
- * 如果在接收过程中出现错误，函数将返回相应的错误状态。
+ * 帧由CAN接收中断（见HAL_CAN_RxFifo0MsgPendingCallback）从硬件FIFO搬入软件接收队列，
+ * 此函数在主循环中读取队列尾部的一帧：头结构从寄存器格式还原，数据负载则直接指向队列槽位中的数据寄存器，
+ * 编码器从那里读取，不再复制。帧发送后必须调用can_rx_release，被过滤时调用can_rx_discard释放槽位；
+ * 不释放则下次调用仍返回同一帧。
+ * 头结构的Timestamp字段是帧到达时TIM2的微秒计数（32位），由队列中保存的低24位和当前计数还原，
+ * 前提是帧在队列中停留不超过约16.7 s。
  *
  * \param rx_msg_header 指向一个CAN_RxHeaderTypeDef结构体的指针，用于存储接收消息的头信息。
- * \param rx_msg_data 指向一个缓冲区的指针，用于存储接收消息的数据负载。缓冲区的大小必须至少为8字节。
+ * \param rx_msg_data 返回指向8个数据字节的指针，在释放槽位之前有效。
  * 
  * \return 函数返回一个uint32_t状态，表示操作的结果。
- *         如果消息成功接收，将返回HAL_OK。
- *         如果在接收过程中出现错误，将返回一个错误代码，这些代码在HAL驱动程序的文档中有详细描述。
+ *         如果队列中有帧，将返回HAL_OK。
+ *         如果软件接收队列为空，或者必须先报告丢失的帧（见can_rx_loss），将返回HAL_ERROR。
  * 
- * \note 此函数不会自动处理CAN总线上的错误状态，也不会管理CAN硬件的任何中断。
- *       在接收消息后，通常应通过适当的指示器或日志机制报告消息接收状态（例如，这里使用了蓝色LED）。
+ * \note 只能在主循环中调用。主循环是接收队列唯一的消费者，接收中断是唯一的生产者，因此无需关中断。
+ */
+uint32_t can_rx(CAN_RxHeaderTypeDef *rx_msg_header, uint8_t **rx_msg_data)
+{
+    // 队列为空，或者丢失记录还没有发出
+    if (!can_rx_absorb() || (rx_seq_enabled && rx_loss.count))
+    {
+        return HAL_ERROR;
+    }
+
+    can_rxframe_t *frame = &rxqueue.frame[RING_TAIL(&rxqueue.ring)];
+
+    // 从寄存器格式还原HAL头结构（两种ID都从RIR取出，调用者按IDE选择）
+    uint32_t rir = frame->rir;
+    rx_msg_header->IDE = rir & CAN_RI0R_IDE;
+    rx_msg_header->RTR = rir & CAN_RI0R_RTR;
+    rx_msg_header->StdId = rir >> CAN_RI0R_STID_Pos;
+    rx_msg_header->ExtId = rir >> CAN_RI0R_EXID_Pos;
+    rx_msg_header->DLC = frame->rdtr & CAN_RDT0R_DLC;
+    rx_msg_header->Timestamp = can_rx_time(frame->rdtr);
+
+    // 数据寄存器为小端且相邻，在内存中就是按顺序排列的8个数据字节
+    *rx_msg_data = (uint8_t *)&frame->rdlr;
+
+    return HAL_OK;
+}
+
+
+/**
+ * \brief 释放can_rx读取的帧的槽位：帧已经发给主机，占用一个序号。
+ *
+ * \note 只能在主循环中调用，且必须在帧的数据读取完成之后。
  */
-uint32_t can_rx(CAN_RxHeaderTypeDef *rx_msg_header, uint8_t* rx_msg_data)
+void can_rx_release(void)
 {
-    // 调用HAL库函数从CAN接收缓冲区中获取一条消息
-    uint32_t status = HAL_CAN_GetRxMessage(&can_handle, CAN_RX_FIFO0, rx_msg_header, rx_msg_data);
+    ring_release(&rxqueue.ring, 1);
+    rx_seq++;
 
     led_blue_on();  // 指示成功接收到消息，例如通过点亮一个蓝色LED
+}
+
 
-    return status;  // 返回操作的结果，可能是成功或错误代码
+// 释放can_rx读取的帧的槽位：帧没有通过软件过滤，不占用序号
+void can_rx_discard(void)
+{
+    ring_release(&rxqueue.ring, 1);
 }
 
 
 /**
- * \brief 检查是否有CAN消息已经接收并在FIFO中等待。
+ * \brief 主循环无法把下一条接收记录交给USB时调用（USB发送缓冲区已满）。
+ *
+ * 最早丢弃策略下，如果队列的空闲槽位少于RXQUEUE_RESERVE，丢弃队列中最早的帧，让新到达的帧仍然可以进入队列。
+ * 丢弃的帧计入丢失记录。其他策略下帧留在队列中，队列满后由接收中断丢弃新到达的帧。
+ */
+void can_rx_overload(void)
+{
+    if (rx_policy != CAN_RX_DROP_OLDEST || ring_space(&rxqueue.ring) >= RXQUEUE_RESERVE || !can_rx_absorb())
+    {
+        return;
+    }
+
+    can_rx_loss_add(1, can_rx_time(rxqueue.frame[RING_TAIL(&rxqueue.ring)].rdtr));
+    ring_release(&rxqueue.ring, 1);
+}
+
+
+/**
+ * \brief 获取在下一帧之前要报告的丢失记录。
+ *
+ * 丢失记录位于丢失发生的位置：它之前的帧都已发出，之后的帧在它发出之前不会被can_rx返回。
+ * 记录发出后调用can_rx_loss_sent。没有打开序号时丢失记录被直接清除，不报告。
+ *
+ * \param loss 返回丢失的帧数、第一帧的到达时间和序号。
+ * \return 有需要报告的丢失时返回HAL_OK，否则返回HAL_ERROR。
+ */
+uint32_t can_rx_loss(can_rxloss_t *loss)
+{
+    can_rx_absorb();
+
+    if (rx_loss.count == 0)
+    {
+        return HAL_ERROR;
+    }
+
+    if (!rx_seq_enabled)
+    {
+        rx_loss.count = 0;
+        return HAL_ERROR;
+    }
+
+    *loss = rx_loss;
+    return HAL_OK;
+}
+
+
+// 丢失记录已经发给主机：丢失的帧占用各自的序号
+void can_rx_loss_sent(void)
+{
+    rx_seq += rx_loss.count;
+    rx_loss.count = 0;
+}
+
+
+// can_rx返回的帧的序号
+uint16_t can_rx_seq(void)
+{
+    return rx_seq;
+}
+
+
+// 设置接收过载策略，见enum can_rx_policy。只有接收中断和主循环各读取一次，可以随时修改
+void can_set_rx_policy(enum can_rx_policy policy)
+{
+    rx_policy = policy;
+}
+
+
+// 打开或关闭接收序号和丢失报告（enable为1时打开）。打开时序号从0开始
+void can_set_rx_seq(uint8_t enable)
+{
+    rx_seq_enabled = enable;
+    rx_seq = 0;
+}
+
+
+// 接收序号是否打开
+uint8_t can_get_rx_seq(void)
+{
+    return rx_seq_enabled;
+}
+
+
+/**
+ * \brief 检查软件接收队列中是否有等待处理的CAN消息。
  * 
- * 此函数查询CAN硬件，以确定接收FIFO中是否有待处理的消息。
  * 如果CAN控制器未连接到总线（OFF_BUS状态），则函数会立即返回0，表示没有待处理的消息。
- * 否则，它会检查指定的FIFO，看是否有接收到的消息。
+ * 否则，它会检查由接收中断填充的软件接收队列是否为空。
  *
- * \param fifo 一个uint8_t值，指定要检查的FIFO。尽管参数名为'fifo'，此函数目前只支持查询CAN_RX_FIFO0。
- *             若要扩展支持其他FIFO，需要修改函数内部的HAL_CAN_GetRxFifoFillLevel调用。
+ * \param fifo 保留参数。硬件FIFO由接收中断负责排空，调用者只需检查软件接收队列。
  * 
  * \return 函数返回一个uint8_t值。
- *         如果FIFO中有消息，则返回1。
+ *         如果队列中有消息，则返回1。
  *         如果没有消息或控制器处于OFF_BUS状态，则返回0。
- * 
- * \note 此函数假设CAN控制器已被适当初始化，并且bus_state变量反映了当前的总线连接状态。
- *       它不会触发消息的接收或处理；它只是指示是否有消息可供其他函数（如can_rx）进一步处理。
  */
 uint8_t is_can_msg_pending(uint8_t fifo)
 {
@@ -457,8 +1152,8 @@ uint8_t is_can_msg_pending(uint8_t fifo)
         // 如果控制器不在总线上，没有消息是待处理的
         return 0;
     }
-    // 查询指定FIFO中的消息数量，返回是否有待处理消息
-    return (HAL_CAN_GetRxFifoFillLevel(&can_handle, CAN_RX_FIFO0) > 0);
+    // 队列中的帧和丢失标记，以及尚未发出的丢失记录
+    return (ring_used(&rxqueue.ring) != 0 || rx_loss.count != 0);
 }
 
 
@@ -481,6 +1176,27 @@ CAN_HandleTypeDef* can_gethandle(void)
 }
 
 
+// 获取接收统计信息（每个硬件FIFO的帧数和溢出次数）
+const can_rxstats_t* can_get_rxstats(void)
+{
+    return &rxstats;
+}
+
+
+// 获取接收队列的环形索引（最高水位，溢出次数即接收队列已满而丢弃的帧数）
+const ring_t* can_get_rxring(void)
+{
+    return &rxqueue.ring;
+}
+
+
+// 获取发送确认队列的环形索引（最高水位和溢出次数）
+const ring_t* can_get_txconfring(void)
+{
+    return &txconf.ring;
+}
+
+
 /**
  * \brief 当CAN接收FIFO 0满时的回调函数。
  * 
@@ -502,3 +1218,213 @@ void HAL_CAN_RxFifo0FullCallback(CAN_HandleTypeDef *hcan)
 }
 
 
+// 在中断上下文中记录一个丢失的帧，丢失数在下一个写入队列的帧之前作为丢失标记写入
+static void can_rx_lose(uint32_t time)
+{
+    if (rx_lost == 0)
+    {
+        rx_lost_time = time;
+    }
+    rx_lost++;
+}
+
+
+// 直接从指定硬件FIFO的输出邮箱寄存器读取一帧到软件接收队列（不经过HAL的状态检查和头结构转换）。
+// 队列已满时仍释放硬件FIFO，该帧被丢弃。
+static void can_rx_fetch(CAN_HandleTypeDef *hcan, uint32_t fifo)
+{
+    uint32_t time = CAN_TIMESTAMP_TIM->CNT; // 尽早锁存到达时间
+    CAN_FIFOMailBox_TypeDef *regs = &hcan->Instance->sFIFOMailBox[fifo];
+    uint32_t rir = regs->RIR;
+
+    // 队列要容纳这一帧和尚未写入的丢失标记；按优先级丢弃时，低优先级帧不能占用保留的槽位
+    uint16_t need = (rx_lost != 0) ? 2 : 1;
+    if (rx_policy == CAN_RX_DROP_PRIORITY && (rir & CAN_RXFRAME_LOW_PRIORITY))
+    {
+        need += RXQUEUE_RESERVE;
+    }
+
+    if (!ring_claim(&rxqueue.ring, need))
+    {
+        // 软件队列已满：直接释放硬件FIFO，丢弃这一帧（计入环形队列的溢出次数和丢失标记）
+        can_rx_lose(time);
+        error_assert(ERR_FULLBUF_CANRX);
+    }
+    else
+    {
+        can_rxframe_t *frame;
+
+        // 先写入丢失标记，主机从它的位置知道丢失发生在哪两帧之间
+        if (rx_lost)
+        {
+            frame = &rxqueue.frame[RING_HEAD(&rxqueue.ring)];
+            frame->rir = CAN_RXFRAME_LOSS;
+            frame->rdtr = rx_lost_time << CAN_RXFRAME_TIME_Pos;
+            frame->rdlr = rx_lost;
+            ring_publish(&rxqueue.ring, 1);
+            rx_lost = 0;
+        }
+
+        // 按寄存器格式复制4个字，DLC之外的RDTR字段（FMI和硬件时间）换成到达时间
+        frame = &rxqueue.frame[RING_HEAD(&rxqueue.ring)];
+        frame->rir = rir;
+        frame->rdtr = (regs->RDTR & CAN_RDT0R_DLC) | (time << CAN_RXFRAME_TIME_Pos);
+        frame->rdlr = regs->RDLR;
+        frame->rdhr = regs->RDHR;
+        rxstats.frames[fifo]++;
+
+        // 帧内容写入完成后才发布
+        ring_publish(&rxqueue.ring, 1);
+        event_post(EVENT_CAN_RX);
+    }
+
+    // 释放FIFO输出邮箱。只写RFOM位：FULL和FOVR是写1清除的标志，读-改-写会误清除溢出标志
+    if (fifo == CAN_RX_FIFO0)
+    {
+        hcan->Instance->RF0R = CAN_RF0R_RFOM0;
+    }
+    else
+    {
+        hcan->Instance->RF1R = CAN_RF1R_RFOM1;
+    }
+}
+
+
+// 在中断上下文中轮流从两个硬件FIFO各取一帧，直到两个FIFO都为空。
+// 轮流读取保证一个FIFO持续有帧时另一个FIFO不会因得不到服务而溢出。
+static void can_rx_drain(CAN_HandleTypeDef *hcan)
+{
+    uint8_t pending;
+
+    do
+    {
+        pending = 0;
+
+        if (hcan->Instance->RF0R & CAN_RF0R_FMP0)
+        {
+            can_rx_fetch(hcan, CAN_RX_FIFO0);
+            pending = 1;
+        }
+
+        if (hcan->Instance->RF1R & CAN_RF1R_FMP1)
+        {
+            can_rx_fetch(hcan, CAN_RX_FIFO1);
+            pending = 1;
+        }
+    } while (pending);
+}
+
+
+/**
+ * \brief CAN接收FIFO 0消息挂起中断回调函数。
+ *
+ * 在中断上下文中一次性排空两个硬件FIFO，把每一帧复制到软件接收队列中。这样主循环即使因USB传输
+ * 阻塞了较长时间，也只需要软件队列足够深，而不依赖每个仅有3个槽位的硬件FIFO。
+ * 如果软件队列已满，仍然读取并释放硬件FIFO中的帧（丢弃最新帧），并记录ERR_FULLBUF_CANRX错误。
+ *
+ * \param hcan 一个指向CAN_HandleTypeDef结构体的指针，表示触发此回调的CAN句柄。
+ */
+void HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef *hcan)
+{
+    can_rx_drain(hcan);
+}
+
+
+/**
+ * \brief CAN接收FIFO 1消息挂起中断回调函数。
+ *
+ * 与FIFO 0共用同一个排空过程。通常FIFO 0的回调已经排空了FIFO 1，此时HAL不会再调用此回调。
+ *
+ * \param hcan 一个指向CAN_HandleTypeDef结构体的指针，表示触发此回调的CAN句柄。
+ */
+void HAL_CAN_RxFifo1MsgPendingCallback(CAN_HandleTypeDef *hcan)
+{
+    can_rx_drain(hcan);
+}
+
+
+// 发送邮箱完成和中止回调：报告邮箱中的帧的发送结果并释放其槽位，被抢占的帧重新排队
+void HAL_CAN_TxMailbox0CompleteCallback(CAN_HandleTypeDef *hcan)
+{
+    can_mailbox_done(0, CAN_TXCONF_OK);
+}
+
+void HAL_CAN_TxMailbox1CompleteCallback(CAN_HandleTypeDef *hcan)
+{
+    can_mailbox_done(1, CAN_TXCONF_OK);
+}
+
+void HAL_CAN_TxMailbox2CompleteCallback(CAN_HandleTypeDef *hcan)
+{
+    can_mailbox_done(2, CAN_TXCONF_OK);
+}
+
+void HAL_CAN_TxMailbox0AbortCallback(CAN_HandleTypeDef *hcan)
+{
+    can_mailbox_done(0, CAN_TXCONF_ABORTED);
+}
+
+void HAL_CAN_TxMailbox1AbortCallback(CAN_HandleTypeDef *hcan)
+{
+    can_mailbox_done(1, CAN_TXCONF_ABORTED);
+}
+
+void HAL_CAN_TxMailbox2AbortCallback(CAN_HandleTypeDef *hcan)
+{
+    can_mailbox_done(2, CAN_TXCONF_ABORTED);
+}
+
+
+/**
+ * \brief CAN错误回调函数。
+ *
+ * 处理接收FIFO溢出：当接收中断来不及排空硬件FIFO时，bxCAN会丢弃帧并置位FOVRx。
+ * 每个FIFO的溢出分别计数，并置位各自的错误位。溢出至少丢失一帧，作为一帧计入丢失标记。
+ * 关闭自动重传时，发送邮箱的仲裁失败和发送错误也在这里报告（HAL把它们作为错误码而不是邮箱回调）。
+ * 为抢占而中止的邮箱如果同时带有仲裁失败或发送错误标志，也会到达这里，按中止处理。
+ *
+ * \param hcan 一个指向CAN_HandleTypeDef结构体的指针，表示触发此回调的CAN句柄。
+ */
+void HAL_CAN_ErrorCallback(CAN_HandleTypeDef *hcan)
+{
+    if (hcan->ErrorCode & HAL_CAN_ERROR_RX_FOV0)
+    {
+        rxstats.overruns[CAN_RX_FIFO0]++;
+        can_rx_lose(CAN_TIMESTAMP_TIM->CNT);
+        error_assert(ERR_CANRXFIFO_OVERFLOW);
+    }
+
+    if (hcan->ErrorCode & HAL_CAN_ERROR_RX_FOV1)
+    {
+        rxstats.overruns[CAN_RX_FIFO1]++;
+        can_rx_lose(CAN_TIMESTAMP_TIM->CNT);
+        error_assert(ERR_CANRXFIFO1_OVERFLOW);
+    }
+
+    // 每个邮箱的HAL_CAN_ERROR_TX_ALSTx和HAL_CAN_ERROR_TX_TERRx位相邻，邮箱之间相隔2位
+    for (uint8_t mailbox = 0; mailbox < 3; mailbox++)
+    {
+        if (!(hcan->ErrorCode & ((HAL_CAN_ERROR_TX_ALST0 | HAL_CAN_ERROR_TX_TERR0) << (2 * mailbox))))
+        {
+            continue;
+        }
+
+        // 被抢占的邮箱通常正在仲裁失败后重试，中止完成时ALSTx（或TERRx）仍然置位，HAL因此不调用中止回调。
+        // 无论这两位如何，都按中止处理，帧重新排队
+        if (mailbox_preempt & (1 << mailbox))
+        {
+            can_mailbox_done(mailbox, CAN_TXCONF_ABORTED);
+        }
+        else if (hcan->ErrorCode & (HAL_CAN_ERROR_TX_ALST0 << (2 * mailbox)))
+        {
+            can_mailbox_done(mailbox, CAN_TXCONF_ARB_LOST);
+        }
+        else
+        {
+            can_mailbox_done(mailbox, CAN_TXCONF_ERROR);
+        }
+    }
+
+    // 清除累积的错误码，以便下次回调只反映新的错误
+    HAL_CAN_ResetError(hcan);
+}
@@ -0,0 +1,46 @@
+//
+// event：主循环的事件标志。中断（CAN、USB、SysTick）置位，主循环取出后只运行有待处理工作的子系统，
+// 没有事件时用WFI休眠，直到下一个中断。
+//
+
+#include "stm32f0xx_hal.h"
+#include "event.h"
+
+
+// Private variables
+static volatile uint32_t event_flags = 0;
+
+
+// 置位事件标志，可以在任何中断或主循环中调用。Cortex-M0没有独占访问指令，读-改-写期间关中断，
+// 避免被更高优先级的中断打断而丢失它置位的标志。
+void event_post(uint32_t events)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    event_flags |= events;
+    __set_PRIMASK(primask);
+}
+
+
+// 主循环：取出并清除所有已置位的事件标志
+uint32_t event_take(void)
+{
+    __disable_irq();
+    uint32_t events = event_flags;
+    event_flags = 0;
+    __enable_irq();
+    return events;
+}
+
+
+// 主循环：没有事件时休眠。检查和WFI在关中断时进行：检查之后到达的中断仍会唤醒WFI，
+// 开中断后立即执行，不会错过事件而一直休眠到下一个SysTick。
+void event_wait(void)
+{
+    __disable_irq();
+    if (event_flags == 0)
+    {
+        __WFI();
+    }
+    __enable_irq();
+}
@@ -0,0 +1,548 @@
+//
+// filter：管理接收过滤器集合，并把它编译到bxCAN的14个过滤器组中
+//
+// 过滤器集合由标准ID位图（每个11位ID一位）和有序的扩展ID表组成。集合为空时按FIFO分流方案接收所有帧；
+// 否则编译器用尽量少的过滤器组表示集合：对齐的连续标准ID块使用16位掩码模式（每组2个），
+// 单个标准ID使用16位列表模式（每组4个），扩展ID使用32位列表模式（每组2个）。
+//
+// 集合放不进过滤器组时，硬件对标准帧或扩展帧（或两者）改为全部接收，由软件第二级精确过滤：
+// 标准ID查位图，扩展ID在有序表中二分查找。软件过滤在can_rx()之后、编码和USB发送之前进行。
+//
+// 另有一个很小的低延迟ID表（ID/掩码对，与32位掩码过滤器相同的比较方式）。通过过滤的帧如果命中此表，
+// 编码后立即发送未满的USB包，不等待与后续帧凑满一包（见cdc_tx_flush）。
+//
+
+#include "stm32f0xx_hal.h"
+#include "can.h"
+#include "filter.h"
+
+
+// 32位过滤器寄存器布局：STID[10:0] | EXID[17:0] | IDE | RTR | 0
+#define FILTER32_ID_MSB   (1UL << 31) // 标准ID的最高位，同时也是扩展ID的最高位
+#define FILTER32_STID_LSB (1UL << 21) // 标准ID的最低位
+#define FILTER32_EXID_LSB (1UL << 3)  // 扩展ID的最低位
+#define FILTER32_IDE      (1UL << 2)  // 扩展帧标志
+
+// 16位过滤器寄存器布局：STID[10:0] | RTR | IDE | EXID[17:15]
+#define FILTER16_STID_SHIFT 5
+#define FILTER16_RTR (1UL << 4)
+#define FILTER16_IDE (1UL << 3)
+#define FILTER16_STD(id) ((uint32_t)(id) << FILTER16_STID_SHIFT)
+
+// 过滤器组模式（filter_write_bank的flags）
+#define FILTER_BANK_MASK  0
+#define FILTER_BANK_LIST  (1 << 0) // 列表模式，否则为掩码模式
+#define FILTER_BANK_32BIT (1 << 1) // 32位宽度，否则为两个16位过滤器
+
+#define FILTER_STD_ORDER_MAX 11 // 最大的对齐块为2^11个ID（全部标准ID）
+
+// 硬件精确过滤的部分（filter_compile的exact），其余部分在硬件中全部接收
+#define FILTER_EXACT_STD (1 << 0)
+#define FILTER_EXACT_EXT (1 << 1)
+
+
+// 编译器的输出状态：未填满的16位过滤器组先暂存，凑满后再写入
+typedef struct filter_emit_
+{
+    uint8_t write; // 0：只统计所需的过滤器组数量
+    uint8_t bank; // 下一个空闲的过滤器组
+    uint8_t list_count;
+    uint8_t mask_count;
+    uint16_t list[4]; // 16位列表模式的ID
+    uint16_t mask[4]; // 16位掩码模式的ID/掩码对
+} filter_emit_t;
+
+
+// Private variables
+static uint32_t filter_std[FILTER_STD_WORDS]; // 标准ID位图，置位表示接收
+static uint32_t filter_ext[FILTER_EXT_MAX]; // 扩展ID，升序排列
+static uint8_t filter_ext_count = 0;
+static uint8_t filter_banks = 0; // 当前占用的过滤器组数量
+static uint8_t filter_active = 0; // 集合非空，软件过滤生效
+static filter_stats_t filter_stats = {0};
+static uint8_t fifo_mode = CAN_FIFO_SINGLE; // 接收FIFO分流模式，决定过滤器如何把帧分配到FIFO 0和FIFO 1
+static filter_urgent_t filter_urgent_table[FILTER_URGENT_MAX]; // 低延迟ID/掩码对
+static uint8_t filter_urgent_count = 0;
+
+
+// 写入一个过滤器组并激活。只能在过滤器初始化模式下调用。
+static void filter_write_bank(uint8_t bank, uint32_t fr1, uint32_t fr2, uint8_t flags, uint8_t fifo)
+{
+    uint32_t bit = 1UL << bank;
+
+    CAN->sFilterRegister[bank].FR1 = fr1;
+    CAN->sFilterRegister[bank].FR2 = fr2;
+    MODIFY_REG(CAN->FM1R, bit, (flags & FILTER_BANK_LIST) ? bit : 0);
+    MODIFY_REG(CAN->FS1R, bit, (flags & FILTER_BANK_32BIT) ? bit : 0);
+    MODIFY_REG(CAN->FFA1R, bit, fifo ? bit : 0);
+    SET_BIT(CAN->FA1R, bit);
+}
+
+
+// 输出编译得到的一个过滤器组。分流模式下各组交替分配到两个FIFO。
+static void filter_emit_bank(filter_emit_t *e, uint32_t fr1, uint32_t fr2, uint8_t flags)
+{
+    if (e->write && e->bank < FILTER_BANKS)
+    {
+        filter_write_bank(e->bank, fr1, fr2, flags, (fifo_mode == CAN_FIFO_SINGLE) ? 0 : (e->bank & 1));
+    }
+    e->bank++;
+}
+
+
+// 写出暂存的16位列表组，空位重复最后一个ID
+static void filter_flush_list(filter_emit_t *e)
+{
+    if (e->list_count == 0)
+    {
+        return;
+    }
+    for (uint8_t i = e->list_count; i < 4; i++)
+    {
+        e->list[i] = e->list[i - 1];
+    }
+    filter_emit_bank(e, e->list[0] | ((uint32_t)e->list[1] << 16), e->list[2] | ((uint32_t)e->list[3] << 16), FILTER_BANK_LIST);
+    e->list_count = 0;
+}
+
+
+// 写出暂存的16位掩码组，空位重复最后一个ID/掩码对
+static void filter_flush_mask(filter_emit_t *e)
+{
+    if (e->mask_count == 0)
+    {
+        return;
+    }
+    if (e->mask_count == 1)
+    {
+        e->mask[2] = e->mask[0];
+        e->mask[3] = e->mask[1];
+    }
+    filter_emit_bank(e, e->mask[0] | ((uint32_t)e->mask[1] << 16), e->mask[2] | ((uint32_t)e->mask[3] << 16), FILTER_BANK_MASK);
+    e->mask_count = 0;
+}
+
+
+static void filter_push_list(filter_emit_t *e, uint16_t id)
+{
+    e->list[e->list_count++] = id;
+    if (e->list_count == 4)
+    {
+        filter_flush_list(e);
+    }
+}
+
+
+static void filter_push_mask(filter_emit_t *e, uint16_t id, uint16_t mask)
+{
+    e->mask[2 * e->mask_count] = id;
+    e->mask[2 * e->mask_count + 1] = mask;
+    if (++e->mask_count == 2)
+    {
+        filter_flush_mask(e);
+    }
+}
+
+
+// 从对齐的id开始的n个标准ID（n为2的幂）是否全部在集合中
+static uint8_t filter_std_all(uint32_t id, uint32_t n)
+{
+    if (n < 32)
+    {
+        uint32_t bits = ((1UL << n) - 1) << (id & 31);
+        return (filter_std[id >> 5] & bits) == bits;
+    }
+
+    for (uint32_t w = id >> 5; w < (id + n) >> 5; w++)
+    {
+        if (filter_std[w] != 0xFFFFFFFF)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+// 从id开始、完全在集合中的最大对齐块的阶数（块大小为2^k）
+static uint8_t filter_std_order(uint32_t id)
+{
+    uint8_t k = 0;
+
+    while (k < FILTER_STD_ORDER_MAX && (id & ((2UL << k) - 1)) == 0 && filter_std_all(id, 2UL << k))
+    {
+        k++;
+    }
+    return k;
+}
+
+
+// 标准ID集合是否为空
+static uint8_t filter_std_empty(void)
+{
+    for (uint8_t w = 0; w < FILTER_STD_WORDS; w++)
+    {
+        if (filter_std[w])
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+// 编译过滤器集合，返回所需的过滤器组数量。write为0时只统计，不访问寄存器。
+// exact中未包含的部分用一个16位掩码过滤器全部接收，留给软件过滤。
+static uint8_t filter_compile(uint8_t write, uint8_t exact)
+{
+    filter_emit_t e = {0};
+    e.write = write;
+
+    if (!(exact & FILTER_EXACT_STD) && !filter_std_empty())
+    {
+        filter_push_mask(&e, 0, FILTER16_IDE);
+    }
+    if (!(exact & FILTER_EXACT_EXT) && filter_ext_count)
+    {
+        filter_push_mask(&e, FILTER16_IDE, FILTER16_IDE);
+    }
+
+    // 标准ID：按升序把集合拆成最大的对齐块，单个ID进入列表组，更大的块进入掩码组
+    for (uint32_t id = 0; (exact & FILTER_EXACT_STD) && id < FILTER_STD_IDS; )
+    {
+        if ((id & 31) == 0 && filter_std[id >> 5] == 0)
+        {
+            id += 32;
+            continue;
+        }
+        if (!(filter_std[id >> 5] & (1UL << (id & 31))))
+        {
+            id++;
+            continue;
+        }
+
+        uint8_t k = filter_std_order(id);
+        if (k == 0)
+        {
+            filter_push_list(&e, FILTER16_STD(id));
+        }
+        else
+        {
+            filter_push_mask(&e, FILTER16_STD(id), FILTER16_STD(~((1UL << k) - 1) & 0x7FF) | FILTER16_IDE);
+        }
+        id += 1UL << k;
+    }
+
+    // 列表和32位列表组只匹配数据帧，远程帧由一个只比较RTR位的16位掩码过滤器全部接收，再由软件过滤
+    filter_push_mask(&e, FILTER16_RTR, FILTER16_RTR);
+
+    // 剩下一个单独的ID时放进掩码组的空位，省掉一个列表组
+    if (e.list_count == 1 && e.mask_count == 1)
+    {
+        e.list_count = 0;
+        filter_push_mask(&e, e.list[0], FILTER16_STD(0x7FF) | FILTER16_RTR | FILTER16_IDE);
+    }
+    filter_flush_list(&e);
+    filter_flush_mask(&e);
+
+    // 扩展ID：每个32位列表组两个
+    for (uint8_t i = 0; (exact & FILTER_EXACT_EXT) && i < filter_ext_count; i += 2)
+    {
+        uint8_t j = (i + 1 < filter_ext_count) ? i + 1 : i;
+        filter_emit_bank(&e, (filter_ext[i] * FILTER32_EXID_LSB) | FILTER32_IDE,
+                             (filter_ext[j] * FILTER32_EXID_LSB) | FILTER32_IDE, FILTER_BANK_LIST | FILTER_BANK_32BIT);
+    }
+
+    return e.bank;
+}
+
+
+/**
+ * \brief 把过滤器集合（集合为空时为FIFO分流方案）写入过滤器组。
+ *
+ * 所有过滤器组在一次过滤器初始化模式中重写，不需要关闭通道。重写期间（几微秒）到达的帧不会被接收。
+ * 过滤器寄存器不受bxCAN复位影响，所以只需在初始化和集合改变时调用。
+ *
+ * 集合放不进过滤器组时，依次尝试在硬件中全部接收扩展帧、标准帧、所有帧，由软件过滤补足。
+ */
+void filter_apply(void)
+{
+    static const uint8_t exact_order[] =
+    {
+        FILTER_EXACT_STD | FILTER_EXACT_EXT, FILTER_EXACT_STD, FILTER_EXACT_EXT, 0
+    };
+    uint8_t i = 0;
+
+    filter_active = !filter_std_empty() || filter_ext_count;
+    if (filter_active)
+    {
+        while (i < sizeof(exact_order) - 1 && filter_compile(0, exact_order[i]) > FILTER_BANKS)
+        {
+            i++;
+        }
+    }
+
+    SET_BIT(CAN->FMR, CAN_FMR_FINIT);
+    CLEAR_BIT(CAN->FA1R, (1UL << FILTER_BANKS) - 1);
+
+    if (filter_active)
+    {
+        filter_banks = filter_compile(1, exact_order[i]);
+    }
+    else
+    {
+        switch (fifo_mode)
+        {
+            case CAN_FIFO_SPLIT_PARITY:
+                // 标准帧和扩展帧的ID最低位位置不同，各需要两个过滤器组
+                filter_write_bank(0, 0, FILTER32_IDE | FILTER32_STID_LSB, FILTER_BANK_32BIT, 0);
+                filter_write_bank(1, FILTER32_STID_LSB, FILTER32_IDE | FILTER32_STID_LSB, FILTER_BANK_32BIT, 1);
+                filter_write_bank(2, FILTER32_IDE, FILTER32_IDE | FILTER32_EXID_LSB, FILTER_BANK_32BIT, 0);
+                filter_write_bank(3, FILTER32_IDE | FILTER32_EXID_LSB, FILTER32_IDE | FILTER32_EXID_LSB, FILTER_BANK_32BIT, 1);
+                filter_banks = 4;
+                break;
+
+            case CAN_FIFO_SPLIT_PRIORITY:
+                // ID最高位为0（标准ID < 0x400，扩展ID < 0x10000000）的高优先级帧进入FIFO 0
+                filter_write_bank(0, 0, FILTER32_ID_MSB, FILTER_BANK_32BIT, 0);
+                filter_write_bank(1, FILTER32_ID_MSB, FILTER32_ID_MSB, FILTER_BANK_32BIT, 1);
+                filter_banks = 2;
+                break;
+
+            case CAN_FIFO_SINGLE:
+            default:
+                // 接收所有帧到FIFO 0
+                filter_write_bank(0, 0, 0, FILTER_BANK_32BIT, 0);
+                filter_banks = 1;
+                break;
+        }
+    }
+
+    CLEAR_BIT(CAN->FMR, CAN_FMR_FINIT);
+}
+
+
+// 设置接收FIFO分流模式并立即生效。过滤器集合非空时，分流模式下过滤器组交替分配到两个FIFO。
+void filter_set_fifo_mode(enum can_fifo_mode mode)
+{
+    fifo_mode = mode;
+    filter_apply();
+}
+
+
+// 清空过滤器集合和统计，恢复接收所有帧
+void filter_clear(void)
+{
+    for (uint8_t w = 0; w < FILTER_STD_WORDS; w++)
+    {
+        filter_std[w] = 0;
+    }
+    filter_ext_count = 0;
+    filter_stats = (filter_stats_t){0};
+    filter_apply();
+}
+
+
+// 有序扩展ID表中第一个不小于id的位置
+static uint8_t filter_ext_find(uint32_t id)
+{
+    uint8_t lo = 0;
+    uint8_t hi = filter_ext_count;
+
+    while (lo < hi)
+    {
+        uint8_t mid = (lo + hi) >> 1;
+        if (filter_ext[mid] < id)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+
+/**
+ * \brief 把满足(ID & mask) == (id & mask)的所有标准ID加入过滤器集合，并立即更新过滤器组。
+ *
+ * \param id 标准ID。
+ * \param mask 掩码，置位的位必须匹配。0x7FF表示单个ID。
+ *
+ * \return HAL_OK；参数超出范围时返回HAL_ERROR。
+ */
+HAL_StatusTypeDef filter_add_std(uint32_t id, uint32_t mask)
+{
+    if (id > 0x7FF || mask > 0x7FF)
+    {
+        return HAL_ERROR;
+    }
+
+    id &= mask;
+    for (uint32_t i = 0; i < FILTER_STD_IDS; i++)
+    {
+        if ((i & mask) == id)
+        {
+            filter_std[i >> 5] |= 1UL << (i & 31);
+        }
+    }
+
+    filter_apply();
+    return HAL_OK;
+}
+
+
+/**
+ * \brief 把一个扩展ID加入过滤器集合，并立即更新过滤器组。
+ *
+ * \param id 扩展ID。
+ *
+ * \return HAL_OK；ID超出范围或扩展ID表已满时返回HAL_ERROR，集合保持不变。
+ */
+HAL_StatusTypeDef filter_add_ext(uint32_t id)
+{
+    if (id > 0x1FFFFFFF)
+    {
+        return HAL_ERROR;
+    }
+
+    uint8_t pos = filter_ext_find(id);
+    if (pos < filter_ext_count && filter_ext[pos] == id)
+    {
+        return HAL_OK;
+    }
+    if (filter_ext_count == FILTER_EXT_MAX)
+    {
+        return HAL_ERROR;
+    }
+
+    // 插入后保持升序
+    for (uint8_t i = filter_ext_count; i > pos; i--)
+    {
+        filter_ext[i] = filter_ext[i - 1];
+    }
+    filter_ext[pos] = id;
+    filter_ext_count++;
+
+    filter_apply();
+    return HAL_OK;
+}
+
+
+// 当前占用的过滤器组数量
+uint8_t filter_banks_used(void)
+{
+    return filter_banks;
+}
+
+
+/**
+ * \brief 软件过滤：接收到的帧是否在过滤器集合中。
+ *
+ * 在can_rx()之后、编码之前调用，被拒绝的帧不再编码和通过USB发送。集合为空时接收所有帧。
+ * 硬件已经精确过滤的帧同样会通过这里，所以通过计数就是主机收到的帧数。
+ *
+ * \param frame_header 接收到的CAN帧头部。
+ *
+ * \return 1表示接收，0表示丢弃。
+ */
+uint8_t filter_match(CAN_RxHeaderTypeDef *frame_header)
+{
+    uint8_t ext = (frame_header->IDE == CAN_ID_EXT);
+    uint8_t hit;
+
+    if (!filter_active)
+    {
+        return 1;
+    }
+
+    if (ext)
+    {
+        uint8_t pos = filter_ext_find(frame_header->ExtId);
+        hit = (pos < filter_ext_count && filter_ext[pos] == frame_header->ExtId);
+    }
+    else
+    {
+        hit = (filter_std[frame_header->StdId >> 5] >> (frame_header->StdId & 31)) & 1;
+    }
+
+    if (hit)
+    {
+        filter_stats.hits[ext]++;
+    }
+    else
+    {
+        filter_stats.drops[ext]++;
+    }
+    return hit;
+}
+
+
+// 把接收帧的ID转换为32位过滤器寄存器布局
+static uint32_t filter_key32(uint32_t ide, uint32_t std_id, uint32_t ext_id)
+{
+    if (ide == CAN_ID_EXT)
+    {
+        return (ext_id * FILTER32_EXID_LSB) | FILTER32_IDE;
+    }
+    return std_id * FILTER32_STID_LSB;
+}
+
+
+// 清空低延迟ID表，所有帧都与后续帧凑满USB包后再发送
+void filter_clear_urgent(void)
+{
+    filter_urgent_count = 0;
+}
+
+
+/**
+ * \brief 把满足(ID & mask) == (id & mask)的ID加入低延迟ID表。
+ *
+ * 低延迟分类与接收过滤器集合无关：只有通过过滤的帧才会被分类，表项不会让更多的帧通过过滤。
+ *
+ * \param ide CAN_ID_STD或CAN_ID_EXT。
+ * \param id 标准ID或扩展ID。
+ * \param mask 掩码，置位的位必须匹配。0x7FF或0x1FFFFFFF表示单个ID。
+ *
+ * \return HAL_OK；参数超出范围或表已满时返回HAL_ERROR。
+ */
+HAL_StatusTypeDef filter_add_urgent(uint32_t ide, uint32_t id, uint32_t mask)
+{
+    uint32_t max = (ide == CAN_ID_EXT) ? 0x1FFFFFFF : 0x7FF;
+
+    if (id > max || mask > max || filter_urgent_count == FILTER_URGENT_MAX)
+    {
+        return HAL_ERROR;
+    }
+
+    filter_urgent_t *entry = &filter_urgent_table[filter_urgent_count++];
+    entry->mask = filter_key32(ide, mask, mask) | FILTER32_IDE;
+    entry->id = filter_key32(ide, id, id) & entry->mask;
+    return HAL_OK;
+}
+
+
+// 通过过滤的帧是否属于低延迟ID，在filter_match()之后调用
+uint8_t filter_urgent(CAN_RxHeaderTypeDef *frame_header)
+{
+    uint32_t key = filter_key32(frame_header->IDE, frame_header->StdId, frame_header->ExtId);
+
+    for (uint8_t i = 0; i < filter_urgent_count; i++)
+    {
+        if (((key ^ filter_urgent_table[i].id) & filter_urgent_table[i].mask) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// 软件过滤统计
+const filter_stats_t* filter_get_stats(void)
+{
+    return &filter_stats;
+}
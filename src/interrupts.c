@@ -6,6 +6,8 @@
 #include "interrupts.h"
 #include "can.h"
 #include "led.h"
+#include "event.h"
+#include "profile.h"
 
 
 
@@ -28,7 +30,9 @@ void HardFault_Handler(void)
 // Handle USB interrupts
 void USB_IRQHandler(void)
 {
+    PROFILE_BEGIN(PROFILE_USB_IRQ);
     HAL_PCD_IRQHandler(&hpcd_USB_FS);
+    PROFILE_END(PROFILE_USB_IRQ);
 }
 
 
@@ -37,11 +41,19 @@ void SysTick_Handler(void)
 {
     HAL_IncTick();
     HAL_SYSTICK_IRQHandler();
+
+    // Let the main loop run its timers (LEDs)
+    event_post(EVENT_TICK);
 }
 
 
 // Handle CAN interrupts
 void CEC_CAN_IRQHandler(void)
 {
+    PROFILE_BEGIN(PROFILE_CAN_IRQ);
     HAL_CAN_IRQHandler(can_gethandle());
+
+    // Load freed TX mailboxes once all mailbox callbacks have run
+    can_tx_refill();
+    PROFILE_END(PROFILE_CAN_IRQ);
 }
@@ -9,9 +9,133 @@
 #include "usbd_cdc_if.h"
 #include "can.h"
 #include "slcan.h"
+#include "binproto.h"
+#include "filter.h"
 #include "system.h"
 #include "led.h"
 #include "error.h"
+#include "event.h"
+#include "profile.h"
+
+
+// 报告一个发送结果和返回发送信用。USB发送缓冲区已满时结果和信用留到下一次。返回1表示可能还有待报告的结果
+static uint8_t main_tx_report(void)
+{
+    can_txconf_t txconf;
+    uint8_t *msg_buf;
+    uint8_t more = 0;
+
+    // 报告发送结果（发送确认打开时）
+    msg_buf = cdc_tx_claim(TX_CLAIM_MAX);
+    if (msg_buf && can_txconf_rx(&txconf) == HAL_OK)
+    {
+        uint16_t msg_len;
+        if (binproto_enabled())
+        {
+            msg_len = binproto_parse_txconf(msg_buf, &txconf);
+        }
+        else
+        {
+            msg_len = slcan_parse_txconf(msg_buf, &txconf);
+        }
+        cdc_tx_publish(msg_len);
+        more = 1;
+    }
+
+    // 返回发送信用（信用流控打开时）。与接收帧一起进入USB发送环形缓冲区，通常搭载在同一个USB包中
+    uint8_t credits = can_credits_due();
+    if (credits && (msg_buf = cdc_tx_claim(TX_CLAIM_MAX)) != NULL)
+    {
+        uint16_t msg_len;
+        if (binproto_enabled())
+        {
+            msg_len = binproto_parse_credits(msg_buf, credits);
+        }
+        else
+        {
+            msg_len = slcan_parse_credits(msg_buf, credits);
+        }
+        cdc_tx_publish(msg_len);
+        can_credits_sent(credits);
+    }
+
+    return more;
+}
+
+
+// 把接收队列中最早的一条记录（丢失记录或帧）交给USB。返回1表示处理了一条记录，0表示队列为空或USB发送缓冲区已满
+static uint8_t main_rx_forward(void)
+{
+    CAN_RxHeaderTypeDef rx_msg_header;
+    uint8_t *rx_msg_data;
+    can_rxloss_t rx_loss;
+    uint8_t *msg_buf;
+
+    // 丢失记录先于它之后的帧发出
+    if (can_rx_loss(&rx_loss) == HAL_OK)
+    {
+        if ((msg_buf = cdc_tx_claim(TX_CLAIM_MAX)) == NULL)
+        {
+            can_rx_overload();
+            return 0;
+        }
+
+        uint16_t msg_len;
+        if (binproto_enabled())
+        {
+            msg_len = binproto_parse_loss(msg_buf, &rx_loss);
+        }
+        else
+        {
+            msg_len = slcan_parse_loss(msg_buf, &rx_loss);
+        }
+        cdc_tx_publish(msg_len);
+        can_rx_loss_sent();
+        return 1;
+    }
+
+    // 读取队列中最早的帧
+    if (can_rx(&rx_msg_header, &rx_msg_data) != HAL_OK)
+    {
+        return 0;
+    }
+
+    // 没有通过软件过滤的帧直接释放
+    if (!filter_match(&rx_msg_header))
+    {
+        can_rx_discard();
+        return 1;
+    }
+
+    // 帧直接从接收队列的槽位编码到USB发送环形缓冲区。缓冲区已满时帧留在接收队列中，
+    // USB发出数据后再试（过载策略见can_rx_overload）
+    if ((msg_buf = cdc_tx_claim(TX_CLAIM_MAX)) == NULL)
+    {
+        can_rx_overload();
+        return 0;
+    }
+
+    PROFILE_BEGIN(PROFILE_ENCODE);
+    uint16_t msg_len;
+    if (binproto_enabled())
+    {
+        msg_len = binproto_parse_frame(msg_buf, &rx_msg_header, rx_msg_data);
+    }
+    else
+    {
+        msg_len = slcan_parse_frame(msg_buf, &rx_msg_header, rx_msg_data);
+    }
+    PROFILE_END(PROFILE_ENCODE);
+    cdc_tx_publish(msg_len);
+
+    // 低延迟ID的帧不等待与后续帧凑满USB包
+    if (filter_urgent(&rx_msg_header))
+    {
+        cdc_tx_flush();
+    }
+    can_rx_release();
+    return 1;
+}
 
 
 int main(void)
@@ -19,38 +143,59 @@ int main(void)
     // 初始化外设
     system_init();
     can_init();
+    binproto_init();
     led_init();
     usb_init();
+#ifdef PROFILE
+    profile_init();
+#endif
 
     led_blue_blink(2);
 
-    // 状态和接收消息缓冲区的存储
-    CAN_RxHeaderTypeDef rx_msg_header;
-    uint8_t rx_msg_data[8] = {0};
-    uint8_t msg_buf[SLCAN_MTU];
-
-
+    // 主循环由事件驱动（见event.h）：中断置位事件标志，主循环只运行有待处理工作的部分，没有事件时休眠。
+    // 每一轮每个部分最多处理一条记录，还有剩余时重新置位自己的事件，使主机命令、发送结果和接收帧交替处理。
+    // 记录因USB发送缓冲区已满而留下时不重新置位，等USB发出数据（EVENT_USB_TX）后再试。
     while(1)
     {
-        cdc_process();
-        led_process();
-        can_process();
+        uint32_t events = event_take();
+        PROFILE_BEGIN(PROFILE_LOOP);
 
-        // 如果 CAN 消息接收待处理，则处理该消息
-        if(is_can_msg_pending(CAN_RX_FIFO0))
+        // 主机命令，可能把帧放入发送队列或改变通道配置
+        if (events & EVENT_USB_RX)
+        {
+            PROFILE_BEGIN(PROFILE_CDC_PROCESS);
+            cdc_process();
+            can_process();
+            PROFILE_END(PROFILE_CDC_PROCESS);
+        }
+
+        if (events & EVENT_TICK)
         {
-			// 如果从总线收到消息，则解析帧
-			if (can_rx(&rx_msg_header, rx_msg_data) == HAL_OK)
-			{
-				uint16_t msg_len = slcan_parse_frame((uint8_t *)&msg_buf, &rx_msg_header, rx_msg_data);
+            led_process();
+        }
+
+        if (events & (EVENT_CAN_TX | EVENT_USB_TX | EVENT_USB_RX))
+        {
+            PROFILE_BEGIN(PROFILE_TX_REPORT);
+            if (main_tx_report())
+            {
+                event_post(EVENT_CAN_TX);
+            }
+            PROFILE_END(PROFILE_TX_REPORT);
+        }
 
-				// 通过USB-CDC传输消息
-				if(msg_len)
-				{
-					CDC_Transmit_FS(msg_buf, msg_len);
-				}
-			}
+        // 如果 CAN 消息接收待处理，则处理该消息
+        if ((events & (EVENT_CAN_RX | EVENT_USB_TX | EVENT_USB_RX)) && is_can_msg_pending(CAN_RX_FIFO0))
+        {
+            PROFILE_BEGIN(PROFILE_RX_FORWARD);
+            if (main_rx_forward())
+            {
+                event_post(EVENT_CAN_RX);
+            }
+            PROFILE_END(PROFILE_RX_FORWARD);
         }
+
+        PROFILE_END(PROFILE_LOOP);
+        event_wait();
     }
 }
-
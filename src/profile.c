@@ -0,0 +1,128 @@
+//
+// profile：逐阶段的周期计数（编译时PROFILE=1才启用）
+//
+// Cortex-M0没有DWT周期计数器。SysTick每1 ms从LOAD向下计数到0，与HAL的毫秒计数合起来就是自启动以来的CPU周期数
+// （32位，约89 s回绕，只用于求差）。每个阶段累计次数、最小值、最大值、总和，以及按4倍分档的直方图，
+// 由诊断命令P读取（见slcan.c）。
+//
+
+#include "stm32f0xx_hal.h"
+#include "profile.h"
+
+#ifdef PROFILE
+
+// Private variables
+static profile_stats_t profile_stats[PROFILE_STAGES];
+static uint32_t profile_overhead = 0; // 一次空测量的周期数，从每个样本中扣除
+
+static const char * const profile_names[PROFILE_STAGES] =
+{
+    "USBIRQ", "CANIRQ", "LOOP", "CDC", "TXREP", "RXFWD", "ENCODE",
+};
+
+
+// 清空所有阶段的统计
+void profile_clear(void)
+{
+    for (uint8_t i = 0; i < PROFILE_STAGES; i++)
+    {
+        profile_stats[i] = (profile_stats_t){ .min = UINT32_MAX };
+    }
+}
+
+
+// 清空统计，并测量一次空的进入/退出，作为以后每个样本的固定开销扣除
+void profile_init(void)
+{
+    uint32_t best = UINT32_MAX;
+
+    for (uint8_t i = 0; i < 8; i++)
+    {
+        uint32_t start = profile_now();
+        uint32_t cycles = profile_now() - start;
+        if (cycles < best)
+        {
+            best = cycles;
+        }
+    }
+    profile_overhead = best;
+    profile_clear();
+}
+
+
+/**
+ * \brief 当前时刻，以CPU周期计。
+ *
+ * 毫秒计数和SysTick计数值在关中断时读取。SysTick已经回绕但中断还没有执行（调用者是更高优先级的中断，
+ * 或者在关中断期间）时，毫秒计数还差1，由挂起位识别：此时重新读取计数值，保证它是回绕之后的值。
+ *
+ * \return 自启动以来的CPU周期数（32位回绕）。
+ */
+uint32_t profile_now(void)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    uint32_t tick = uwTick;
+    uint32_t val = SysTick->VAL;
+    if (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk)
+    {
+        val = SysTick->VAL;
+        tick++;
+    }
+
+    __set_PRIMASK(primask);
+
+    uint32_t load = SysTick->LOAD;
+    return tick * (load + 1) + (load - val);
+}
+
+
+// 记录一个阶段从start（profile_now）到现在的周期数。可以在中断和主循环中调用。
+void profile_record(enum profile_stage stage, uint32_t start)
+{
+    uint32_t cycles = profile_now() - start;
+    cycles = (cycles > profile_overhead) ? cycles - profile_overhead : 0;
+
+    // 直方图：低于64个周期为第0档，之后每4倍一档
+    uint8_t bin = 0;
+    for (uint32_t d = cycles >> 6; d && bin < PROFILE_BINS - 1; d >>= 2)
+    {
+        bin++;
+    }
+
+    // 中断中的阶段可能打断主循环中同一结构的更新，统计的读-改-写在关中断时进行
+    profile_stats_t *stats = &profile_stats[stage];
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    stats->count++;
+    stats->sum += cycles;
+    if (cycles < stats->min)
+    {
+        stats->min = cycles;
+    }
+    if (cycles > stats->max)
+    {
+        stats->max = cycles;
+    }
+    stats->hist[bin]++;
+    __set_PRIMASK(primask);
+}
+
+
+// 复制一个阶段的统计。中断中的阶段随时可能更新，复制在关中断时进行，得到一致的快照
+void profile_get_stats(enum profile_stage stage, profile_stats_t *stats)
+{
+    __disable_irq();
+    *stats = profile_stats[stage];
+    __enable_irq();
+}
+
+
+// 阶段名称，用于诊断输出
+const char* profile_stage_name(enum profile_stage stage)
+{
+    return profile_names[stage];
+}
+
+#endif // PROFILE
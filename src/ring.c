@@ -0,0 +1,62 @@
+//
+// ring：单生产者单消费者环形队列的索引管理，用于中断和主循环之间传递数据
+//
+// 生产者只写head，消费者只写tail，两者都只在各自一侧推进，因此不需要关中断。
+// 索引自由运行（16位回绕），队列长度为2的幂，用掩码代替取模（Cortex-M0没有除法指令），所有槽位都可用。
+// 内存屏障保证：生产者先写数据再发布head，消费者先读head再读数据、读完数据再释放tail。
+//
+
+#include "stm32f0xx_hal.h"
+#include "ring.h"
+
+
+// 消费者一侧：已填充的槽位数。返回后可以读取这些槽位中的数据。
+uint16_t ring_used(ring_t *ring)
+{
+    uint16_t used = ring->head - ring->tail;
+    __DMB(); // 先读head，再读它发布的数据
+    return used;
+}
+
+
+// 生产者一侧：空闲的槽位数。返回后可以写入这些槽位。
+uint16_t ring_space(ring_t *ring)
+{
+    uint16_t space = RING_SIZE(ring) - (uint16_t)(ring->head - ring->tail);
+    __DMB(); // 先读tail，再改写它释放的槽位
+    return space;
+}
+
+
+// 生产者一侧：检查是否有n个空闲槽位。空间不足时计入溢出次数并返回0。
+uint8_t ring_claim(ring_t *ring, uint16_t n)
+{
+    if (ring_space(ring) < n)
+    {
+        ring->overflows++;
+        return 0;
+    }
+    return 1;
+}
+
+
+// 生产者一侧：发布已写入的n个槽位，并更新最高水位
+void ring_publish(ring_t *ring, uint16_t n)
+{
+    __DMB(); // 数据写完后才发布head
+    ring->head += n;
+
+    uint16_t used = ring->head - ring->tail;
+    if (used > ring->high_water)
+    {
+        ring->high_water = used;
+    }
+}
+
+
+// 消费者一侧：释放已读取的n个槽位
+void ring_release(ring_t *ring, uint16_t n)
+{
+    __DMB(); // 数据读完后才释放槽位
+    ring->tail += n;
+}
@@ -7,8 +7,60 @@
 #include "can.h"
 #include "error.h"
 #include "slcan.h"
+#include "binproto.h"
+#include "filter.h"
 #include "printf.h"
 #include "usbd_cdc_if.h"
+#include "profile.h"
+
+
+// Private variables
+static uint8_t slcan_timestamp_mode = SLCAN_TIMESTAMP_OFF;
+
+
+// 当前命令是否已经发送了应答。有应答的命令以应答末尾的'\r'作为确认
+static uint8_t slcan_replied = 0;
+
+
+// 发送命令应答。二进制模式下应答被封装为文本记录。
+static void slcan_reply(char *str)
+{
+    slcan_replied = 1;
+    if (binproto_enabled())
+    {
+        binproto_send(BINPROTO_TYPE_TEXT, (uint8_t*)str, strlen(str));
+    }
+    else
+    {
+        CDC_Transmit_FS((uint8_t*)str, strlen(str));
+    }
+}
+
+
+// 字节到两个ASCII十六进制字符的查找表（位于flash）
+static const char slcan_hex_byte[256][2] =
+{
+    "00", "01", "02", "03", "04", "05", "06", "07", "08", "09", "0A", "0B", "0C", "0D", "0E", "0F",
+    "10", "11", "12", "13", "14", "15", "16", "17", "18", "19", "1A", "1B", "1C", "1D", "1E", "1F",
+    "20", "21", "22", "23", "24", "25", "26", "27", "28", "29", "2A", "2B", "2C", "2D", "2E", "2F",
+    "30", "31", "32", "33", "34", "35", "36", "37", "38", "39", "3A", "3B", "3C", "3D", "3E", "3F",
+    "40", "41", "42", "43", "44", "45", "46", "47", "48", "49", "4A", "4B", "4C", "4D", "4E", "4F",
+    "50", "51", "52", "53", "54", "55", "56", "57", "58", "59", "5A", "5B", "5C", "5D", "5E", "5F",
+    "60", "61", "62", "63", "64", "65", "66", "67", "68", "69", "6A", "6B", "6C", "6D", "6E", "6F",
+    "70", "71", "72", "73", "74", "75", "76", "77", "78", "79", "7A", "7B", "7C", "7D", "7E", "7F",
+    "80", "81", "82", "83", "84", "85", "86", "87", "88", "89", "8A", "8B", "8C", "8D", "8E", "8F",
+    "90", "91", "92", "93", "94", "95", "96", "97", "98", "99", "9A", "9B", "9C", "9D", "9E", "9F",
+    "A0", "A1", "A2", "A3", "A4", "A5", "A6", "A7", "A8", "A9", "AA", "AB", "AC", "AD", "AE", "AF",
+    "B0", "B1", "B2", "B3", "B4", "B5", "B6", "B7", "B8", "B9", "BA", "BB", "BC", "BD", "BE", "BF",
+    "C0", "C1", "C2", "C3", "C4", "C5", "C6", "C7", "C8", "C9", "CA", "CB", "CC", "CD", "CE", "CF",
+    "D0", "D1", "D2", "D3", "D4", "D5", "D6", "D7", "D8", "D9", "DA", "DB", "DC", "DD", "DE", "DF",
+    "E0", "E1", "E2", "E3", "E4", "E5", "E6", "E7", "E8", "E9", "EA", "EB", "EC", "ED", "EE", "EF",
+    "F0", "F1", "F2", "F3", "F4", "F5", "F6", "F7", "F8", "F9", "FA", "FB", "FC", "FD", "FE", "FF",
+};
+
+
+// 写入一个字节的两个十六进制字符
+#define SLCAN_PUT_BYTE(p, b) do { const char *h_ = slcan_hex_byte[(uint8_t)(b)]; (p)[0] = h_[0]; (p)[1] = h_[1]; (p) += 2; } while (0)
 
 
 /**
@@ -17,154 +69,796 @@
  * 此函数接收一个CAN帧的头部和数据，将其转换为slcan协议的ASCII表示形式。
  * slcan协议用于在串行链路上通过文本形式传输CAN帧，通常用于CAN总线调试和监视工具。
  *
- * \param buf 一个指向存储解析后的slcan消息的缓冲区的指针。该缓冲区必须足够大以容纳转换后的消息。
+ * 每个字节通过查找表直接写出最终的两个ASCII字符，不需要预先清空缓冲区，也没有第二遍转换。
+ * 标准帧和扩展帧的ID分别使用专门的路径，远程帧和DLC为0的帧不写数据字节。
+ *
+ * 时间戳模式打开时（Z命令），在回车符之前附加帧头结构中的Timestamp（微秒）。
+ *
+ * \param buf 一个指向存储解析后的slcan消息的缓冲区的指针。该缓冲区必须足够大以容纳转换后的消息（最多SLCAN_MTU字节）。
  * \param frame_header 指向包含CAN帧头部信息的CAN_RxHeaderTypeDef结构的指针。
  *                     这包括标准/扩展帧标识符、远程传输请求（RTR）标志等。
  * \param frame_data 指向包含CAN帧数据的字节数组的指针。
  *
  * \return 返回解析后的slcan消息中的字节数。这可以用于后续将消息发送到串行接口或进行其他处理。
- *         如果发生错误，函数可以返回一个负值，表明无法正确解析帧。
  *
  * \note 此函数假设输入的CAN帧是有效的，并且缓冲区空间足以容纳slcan消息。
  *       在调用此函数之前，调用者必须验证这些条件。该函数不会更改原始的CAN帧数据。
  */
 int8_t slcan_parse_frame(uint8_t *buf, CAN_RxHeaderTypeDef *frame_header, uint8_t* frame_data)
 {
-    uint8_t msg_position = 0; // 用于追踪slcan消息中的当前位置
+    uint8_t *p = buf;
+    uint32_t dlc = frame_header->DLC & 0xF;
 
-    // 清空缓冲区，准备填充slcan消息
-    for (uint8_t j=0; j < SLCAN_MTU; j++)
+    // 帧类型字符：数据帧't'，远程请求帧'r'，扩展帧为大写
+    uint8_t type = (frame_header->RTR == CAN_RTR_REMOTE) ? 'r' : 't';
+
+    if (frame_header->IDE == CAN_ID_EXT)
     {
-        buf[j] = '\0';
+        // 扩展帧：8个十六进制字符（29位ID）
+        uint32_t can_id = frame_header->ExtId;
+        *p++ = type - 32;
+        SLCAN_PUT_BYTE(p, can_id >> 24);
+        SLCAN_PUT_BYTE(p, can_id >> 16);
+        SLCAN_PUT_BYTE(p, can_id >> 8);
+        SLCAN_PUT_BYTE(p, can_id);
     }
-
-    // 根据帧类型（数据帧或远程请求帧）添加字符
-    if (frame_header->RTR == CAN_RTR_DATA)
+    else
     {
-        buf[msg_position] = 't'; // 数据帧
-    } else if (frame_header->RTR == CAN_RTR_REMOTE) {
-        buf[msg_position] = 'r'; // 远程请求帧
+        // 标准帧：3个十六进制字符（11位ID），第一个字符取查找表中低位字符
+        uint32_t can_id = frame_header->StdId;
+        *p++ = type;
+        *p++ = slcan_hex_byte[(can_id >> 8) & 0xF][1];
+        SLCAN_PUT_BYTE(p, can_id);
     }
-    msg_position++; // 移动到下一个填充位置
 
-    // 默认使用标准标识符长度
-    uint8_t id_len = SLCAN_STD_ID_LEN;
-    uint32_t can_id = frame_header->StdId;
+    // 数据长度代码（DLC）只有一个十六进制字符
+    *p++ = slcan_hex_byte[dlc][1];
 
-    // 如果是扩展帧，则需要调整标识符长度和获取相应的ID
-    if (frame_header->IDE == CAN_ID_EXT)
+    // 远程帧没有数据字节
+    if (type == 't')
     {
-        buf[msg_position] -= 32; // 扩展帧，字符转为大写
-        id_len = SLCAN_EXT_ID_LEN;
-        can_id = frame_header->ExtId;
+        for (uint32_t j = 0; j < dlc && j < 8; j++)
+        {
+            SLCAN_PUT_BYTE(p, frame_data[j]);
+        }
     }
-    msg_position++;
 
-    // 将CAN ID添加到缓冲区
-    for(uint8_t j = id_len; j > 0; j--)
+    // 附加时间戳
+    if (slcan_timestamp_mode == SLCAN_TIMESTAMP_MS)
     {
-        // 按4位一组（一个半字节）添加到缓冲区
-        buf[j] = (can_id & 0xF);
-        can_id = can_id >> 4;
-        msg_position++;
+        uint32_t ms = (frame_header->Timestamp / 1000) % 60000;
+        SLCAN_PUT_BYTE(p, ms >> 8);
+        SLCAN_PUT_BYTE(p, ms);
     }
-
-    // 将数据长度代码（DLC）添加到缓冲区
-    buf[msg_position++] = frame_header->DLC;
-
-    // 添加数据字节到缓冲区
-    for (uint8_t j = 0; j < frame_header->DLC; j++)
+    else if (slcan_timestamp_mode == SLCAN_TIMESTAMP_US)
     {
-        buf[msg_position++] = (frame_data[j] >> 4); // 先添加高半字节
-        buf[msg_position++] = (frame_data[j] & 0x0F); // 再添加低半字节
+        uint32_t us = frame_header->Timestamp;
+        SLCAN_PUT_BYTE(p, us >> 24);
+        SLCAN_PUT_BYTE(p, us >> 16);
+        SLCAN_PUT_BYTE(p, us >> 8);
+        SLCAN_PUT_BYTE(p, us);
     }
 
-    // 将消息内容从二进制转换为ASCII字符表示
-    // 转换规则是：0-9的数字转换为'0'-'9'，10-15的数转换为'A'-'F'
-    for (uint8_t j = 1; j < msg_position; j++)
+    // 附加接收序号：4个十六进制字符（非标准）
+    if (can_get_rx_seq())
     {
-        if (buf[j] < 0xA) {
-            buf[j] += 0x30; // 数字0-9
-        } else {
-            buf[j] += 0x37; // 字母A-F
-        }
+        uint16_t seq = can_rx_seq();
+        SLCAN_PUT_BYTE(p, seq >> 8);
+        SLCAN_PUT_BYTE(p, seq);
     }
 
     // 在slcan消息末尾添加回车符，标记消息结束
-    buf[msg_position++] = '\r';
+    *p++ = '\r';
 
     // 返回填充的slcan消息长度
-    return msg_position;
+    return p - buf;
 }
 
 
 /**
- * \brief 解析通过USB CDC接收的slcan命令字符串。
+ * \brief 将一条接收丢失记录编码为slcan丢失消息（非标准）：lSSSSCCCCCCCCTTTTTTTT\r。
  *
- * 这个函数根据slcan协议解释命令字符串。
- * 它处理各种slcan命令以控制CAN接口或
- * 提交CAN帧。通常用于USB接口模拟CAN网络接口的场景。
+ * SSSS是第一个丢失帧的序号，CCCCCCCC是丢失的帧数，TTTTTTTT是第一个丢失帧的到达时间（微秒），均为十六进制。
+ * 丢失的帧占用序号SSSS到SSSS+CCCCCCCC-1，下一帧的序号接着计数。
  *
- * \param buf 包含slcan命令字符串的缓冲区指针。
- * \param len 命令字符串的长度。
+ * \param buf 输出缓冲区，至少22字节。
+ * \param loss 丢失记录。
  *
- * \return 如果命令成功处理，则返回0。
- *         如果命令未知或发生错误，则返回-1。
+ * \return 编码后的字节数。
  */
-int8_t slcan_parse_str(uint8_t *buf, uint8_t len)
+int8_t slcan_parse_loss(uint8_t *buf, can_rxloss_t *loss)
+{
+    uint8_t *p = buf;
+
+    *p++ = 'l';
+    SLCAN_PUT_BYTE(p, loss->seq >> 8);
+    SLCAN_PUT_BYTE(p, loss->seq);
+    SLCAN_PUT_BYTE(p, loss->count >> 24);
+    SLCAN_PUT_BYTE(p, loss->count >> 16);
+    SLCAN_PUT_BYTE(p, loss->count >> 8);
+    SLCAN_PUT_BYTE(p, loss->count);
+    SLCAN_PUT_BYTE(p, loss->time >> 24);
+    SLCAN_PUT_BYTE(p, loss->time >> 16);
+    SLCAN_PUT_BYTE(p, loss->time >> 8);
+    SLCAN_PUT_BYTE(p, loss->time);
+    *p++ = '\r';
+
+    return p - buf;
+}
+
+
+/**
+ * \brief 将返回给主机的发送信用编码为slcan信用消息（非标准）：cNN\r，NN为信用数（2个十六进制字符）。
+ *
+ * \param buf 输出缓冲区，至少4字节。
+ * \param credits 信用数。
+ *
+ * \return 编码后的字节数。
+ */
+int8_t slcan_parse_credits(uint8_t *buf, uint8_t credits)
 {
-	CAN_TxHeaderTypeDef frame_header;// 定义一个CAN帧头结构体变量
+    uint8_t *p = buf;
+
+    *p++ = 'c';
+    SLCAN_PUT_BYTE(p, credits);
+    *p++ = '\r';
+
+    return p - buf;
+}
+
+
+/**
+ * \brief 将一个发送结果编码为slcan确认消息（非标准）：xTTR\r。
+ *
+ * TT是主机提供的标签（2个十六进制字符），R是结果（enum can_txconf_result）：
+ * 0已发送，1仲裁失败，2错误，3已中止。
+ *
+ * \param buf 输出缓冲区，至少5字节。
+ * \param conf 发送结果。
+ *
+ * \return 编码后的字节数。
+ */
+int8_t slcan_parse_txconf(uint8_t *buf, can_txconf_t *conf)
+{
+    uint8_t *p = buf;
+
+    *p++ = 'x';
+    SLCAN_PUT_BYTE(p, conf->tag);
+    *p++ = slcan_hex_byte[conf->result & 0xF][1];
+    *p++ = '\r';
+
+    return p - buf;
+}
+
+
+// 每个字节加上该常量后，bit7表示该字节是否不小于c（要求所有字节都小于0x80，不会产生进位）
+#define SLCAN_SWAR_GE(w, c) (((w) + 0x01010101UL * (0x80 - (c))) & 0x80808080UL)
+
+
+/**
+ * \brief 一次解码最多4个十六进制字符（SWAR：在一个32位字中并行处理4个字节）。
+ *
+ * 每个字节通道并行判断是否为'0'-'9'、'A'-'F'或'a'-'f'，并把合法字符转换为半字节，
+ * 最后把4个半字节合并为一个值。非法字符（包括'G'、控制字符和非ASCII字节）会被拒绝。
+ *
+ * \param p 指向第一个字符。Cortex-M0不支持非对齐字访问，因此逐字节装入。
+ * \param n 字符个数（1-4），不足4个时高位通道用'0'填充。
+ *
+ * \return 解码后的值，如果有非法字符则返回-1。
+ */
+static int32_t slcan_hex4(const uint8_t *p, uint8_t n)
+{
+    uint32_t w = 0x30303030UL; // '0'
+    for (uint8_t i = 0; i < n; i++)
+    {
+        w &= ~(0xFFUL << (i * 8));
+        w |= (uint32_t)p[i] << (i * 8);
+    }
+
+    if (w & 0x80808080UL)
+    {
+        return -1;
+    }
+
+    uint32_t lower = w | 0x20202020UL; // 字母转为小写
+    uint32_t digit = SLCAN_SWAR_GE(w, '0') & ~SLCAN_SWAR_GE(w, '9' + 1);
+    uint32_t alpha = SLCAN_SWAR_GE(lower, 'a') & ~SLCAN_SWAR_GE(lower, 'f' + 1);
+    if ((digit | alpha) != 0x80808080UL)
+    {
+        return -1;
+    }
+
+    // 数字的低4位就是其值，字母的低4位再加9
+    alpha >>= 7;
+    uint32_t nib = (w & 0x0F0F0F0FUL) + alpha + (alpha << 3);
+
+    // 合并半字节：第一个字符在最低字节通道，是最高的半字节
+    nib = ((nib & 0x000F000FUL) << 4) | ((nib >> 8) & 0x000F000FUL);
+    uint32_t val = ((nib & 0xFF) << 8) | ((nib >> 16) & 0xFF);
+
+    return val >> (4 * (4 - n));
+}
 
-	// 为新的CAN帧设置默认值
-	frame_header.IDE = CAN_ID_STD;
+
+// 解析只有一个十六进制数字参数的命令（例如S6、M1），返回参数或错误码
+static int32_t slcan_arg(uint8_t *buf, uint8_t len)
+{
+    if (len != 2)
+    {
+        return SLCAN_ERR_LEN;
+    }
+
+    int32_t arg = slcan_hex4(&buf[1], 1);
+    return (arg < 0) ? SLCAN_ERR_HEX : arg;
+}
+
+
+// 解析发送命令：tIIILDD...、TIIIIIIIILDD...、rIIIL、RIIIIIIIIL
+// 发送确认打开时，命令末尾可以附加2个十六进制字符的标签：tIIILDD...TT
+static int8_t slcan_parse_tx(uint8_t *buf, uint8_t len)
+{
+    CAN_TxHeaderTypeDef frame_header; // 定义一个CAN帧头结构体变量
+    uint8_t frame_data[8] = {0};
+    uint8_t msg_position;
+    int32_t val;
+
+    frame_header.RTR = (buf[0] == 'r' || buf[0] == 'R') ? CAN_RTR_REMOTE : CAN_RTR_DATA;
     frame_header.StdId = 0;
     frame_header.ExtId = 0;
 
+    // Save CAN ID depending on ID type
+    if (buf[0] == 'T' || buf[0] == 'R')
+    {
+        if (len < 1 + SLCAN_EXT_ID_LEN + 1)
+        {
+            return SLCAN_ERR_LEN;
+        }
+
+        int32_t hi = slcan_hex4(&buf[1], 4);
+        val = slcan_hex4(&buf[5], 4);
+        if (hi < 0 || val < 0)
+        {
+            return SLCAN_ERR_HEX;
+        }
+
+        frame_header.IDE = CAN_ID_EXT;
+        frame_header.ExtId = ((uint32_t)hi << 16) | val;
+        if (frame_header.ExtId > 0x1FFFFFFF)
+        {
+            return SLCAN_ERR_RANGE;
+        }
+        msg_position = 1 + SLCAN_EXT_ID_LEN;
+    }
+    else
+    {
+        if (len < 1 + SLCAN_STD_ID_LEN + 1)
+        {
+            return SLCAN_ERR_LEN;
+        }
+
+        val = slcan_hex4(&buf[1], SLCAN_STD_ID_LEN);
+        if (val < 0)
+        {
+            return SLCAN_ERR_HEX;
+        }
+        if (val > 0x7FF)
+        {
+            return SLCAN_ERR_RANGE;
+        }
+
+        frame_header.IDE = CAN_ID_STD;
+        frame_header.StdId = val;
+        msg_position = 1 + SLCAN_STD_ID_LEN;
+    }
+
+    // Attempt to parse DLC and check sanity
+    val = slcan_hex4(&buf[msg_position++], 1);
+    if (val < 0)
+    {
+        return SLCAN_ERR_HEX;
+    }
+    if (val > 8)
+    {
+        return SLCAN_ERR_RANGE;
+    }
+    frame_header.DLC = val;
+
+    // Remote frames carry no data; the length must match the DLC exactly, plus an optional tag
+    uint8_t data_len = (frame_header.RTR == CAN_RTR_DATA) ? frame_header.DLC : 0;
+    uint8_t frame_len = msg_position + 2 * data_len;
+    uint8_t tag = 0;
+    if (len == frame_len + 2 && can_get_txconf())
+    {
+        val = slcan_hex4(&buf[frame_len], 2);
+        if (val < 0)
+        {
+            return SLCAN_ERR_HEX;
+        }
+        tag = val;
+    }
+    else if (len != frame_len)
+    {
+        return SLCAN_ERR_LEN;
+    }
 
-    // 将ASCII字符转换为它们的数值表示
-    for (uint8_t i = 1; i < len; i++)
+    // Decode frame data, 4 characters (2 bytes) at a time
+    for (uint8_t j = 0; j < data_len; j += 2)
     {
-        // 小写字母
-        if(buf[i] >= 'a')
-            buf[i] = buf[i] - 'a' + 10;// 转换为对应的数值
-        // Uppercase letters
-        else if(buf[i] >= 'A')
-            buf[i] = buf[i] - 'A' + 10;
-        // Numbers
+        uint8_t chars = (data_len - j >= 2) ? 4 : 2;
+        val = slcan_hex4(&buf[msg_position], chars);
+        if (val < 0)
+        {
+            return SLCAN_ERR_HEX;
+        }
+
+        if (chars == 4)
+        {
+            frame_data[j] = val >> 8;
+            frame_data[j + 1] = val;
+        }
         else
-            buf[i] = buf[i] - '0';
+        {
+            frame_data[j] = val;
+        }
+        msg_position += chars;
+    }
+
+    // Transmit the message
+    can_tx(&frame_header, frame_data, tag);
+
+    return SLCAN_OK;
+}
+
+
+// 解码n个十进制字符（1-7个），非法字符返回-1
+static int32_t slcan_dec(const uint8_t *p, uint8_t n)
+{
+    int32_t val = 0;
+
+    if (n == 0 || n > 7)
+    {
+        return -1;
+    }
+
+    for (uint8_t i = 0; i < n; i++)
+    {
+        if (p[i] < '0' || p[i] > '9')
+        {
+            return -1;
+        }
+        val = val * 10 + (p[i] - '0');
+    }
+
+    return val;
+}
+
+
+// 解析位时序命令（非标准）：
+//   sXXXXXXXX       原始BTR寄存器值（8个十六进制字符）
+//   sBITRATE[@SP]   十进制比特率（bit/s）和可选的十进制采样点（‰，默认CAN_SAMPLE_POINT_DEFAULT）
+static int8_t slcan_parse_timing(uint8_t *buf, uint8_t len)
+{
+    HAL_StatusTypeDef status;
+
+    int32_t hi = (len == 9) ? slcan_hex4(&buf[1], 4) : -1;
+    int32_t lo = (len == 9) ? slcan_hex4(&buf[5], 4) : -1;
+    if (hi >= 0 && lo >= 0)
+    {
+        status = can_set_btr(((uint32_t)hi << 16) | lo);
+    }
+    else
+    {
+        uint8_t at = 1;
+        while (at < len && buf[at] != '@')
+        {
+            at++;
+        }
+
+        int32_t bitrate = slcan_dec(&buf[1], at - 1);
+        int32_t sample_point = CAN_SAMPLE_POINT_DEFAULT;
+        if (at < len)
+        {
+            sample_point = slcan_dec(&buf[at + 1], len - at - 1);
+        }
+
+        if (bitrate < 0 || sample_point < 0)
+        {
+            return SLCAN_ERR_HEX;
+        }
+
+        status = can_set_bittiming(bitrate, sample_point);
+    }
+
+    if (status == HAL_BUSY)
+    {
+        return SLCAN_ERR_BUSY;
+    }
+    return (status == HAL_OK) ? SLCAN_OK : SLCAN_ERR_RANGE;
+}
+
+
+// 解析过滤器命令（非标准），过滤器组立即更新，不需要关闭通道：
+//   f               报告占用的过滤器组数量和软件过滤统计（标准帧/扩展帧的通过/丢弃数）
+//   fC              清空过滤器集合，接收所有帧
+//   ftIII[MMM]      加入标准ID，可选掩码（置位的位必须匹配）
+//   fTIIIIIIII      加入扩展ID
+//   fuC, futIII[MMM], fuTIIIIIIII[MMMMMMMM]  同上，但操作低延迟ID表：命中的帧立即发送，不等待凑满USB包
+static int8_t slcan_parse_filter(uint8_t *buf, uint8_t len)
+{
+    HAL_StatusTypeDef status;
+    int32_t id;
+    int32_t mask = 0x7FF;
+    uint8_t urgent = (len > 1 && buf[1] == 'u');
+
+    // 低延迟ID表的命令格式与过滤器集合相同，跳过'u'后一起解析
+    if (urgent)
+    {
+        buf++;
+        len--;
+        if (len == 1)
+        {
+            return SLCAN_ERR_LEN;
+        }
+    }
+
+    if (len == 1)
+    {
+        const filter_stats_t *stats = filter_get_stats();
+        char infostr[64] = {0};
+        snprintf_(infostr, sizeof(infostr), "FILTER %u/%u STD %u/%u EXT %u/%u\r",
+                (unsigned int)filter_banks_used(), FILTER_BANKS,
+                (unsigned int)stats->hits[0], (unsigned int)stats->drops[0],
+                (unsigned int)stats->hits[1], (unsigned int)stats->drops[1]);
+        slcan_reply(infostr);
+        return SLCAN_OK;
+    }
+
+    switch (buf[1])
+    {
+        case 'C':
+            if (len != 2)
+            {
+                return SLCAN_ERR_LEN;
+            }
+            if (urgent)
+            {
+                filter_clear_urgent();
+            }
+            else
+            {
+                filter_clear();
+            }
+            return SLCAN_OK;
+
+        case 't':
+            if (len != 2 + SLCAN_STD_ID_LEN && len != 2 + 2 * SLCAN_STD_ID_LEN)
+            {
+                return SLCAN_ERR_LEN;
+            }
+            id = slcan_hex4(&buf[2], SLCAN_STD_ID_LEN);
+            if (len == 2 + 2 * SLCAN_STD_ID_LEN)
+            {
+                mask = slcan_hex4(&buf[2 + SLCAN_STD_ID_LEN], SLCAN_STD_ID_LEN);
+            }
+            if (id < 0 || mask < 0)
+            {
+                return SLCAN_ERR_HEX;
+            }
+            status = urgent ? filter_add_urgent(CAN_ID_STD, id, mask) : filter_add_std(id, mask);
+            break;
+
+        case 'T':
+        {
+            // 只有低延迟ID表支持扩展ID掩码
+            if (len != 2 + SLCAN_EXT_ID_LEN && !(urgent && len == 2 + 2 * SLCAN_EXT_ID_LEN))
+            {
+                return SLCAN_ERR_LEN;
+            }
+            int32_t hi = slcan_hex4(&buf[2], 4);
+            int32_t lo = slcan_hex4(&buf[6], 4);
+            int32_t mask_hi = 0x1FFF;
+            int32_t mask_lo = 0xFFFF;
+            if (len == 2 + 2 * SLCAN_EXT_ID_LEN)
+            {
+                mask_hi = slcan_hex4(&buf[10], 4);
+                mask_lo = slcan_hex4(&buf[14], 4);
+            }
+            if (hi < 0 || lo < 0 || mask_hi < 0 || mask_lo < 0)
+            {
+                return SLCAN_ERR_HEX;
+            }
+            if (urgent)
+            {
+                status = filter_add_urgent(CAN_ID_EXT, ((uint32_t)hi << 16) | lo, ((uint32_t)mask_hi << 16) | mask_lo);
+            }
+            else
+            {
+                status = filter_add_ext(((uint32_t)hi << 16) | lo);
+            }
+            break;
+        }
+
+        default:
+            return SLCAN_ERR_CMD;
+    }
+
+    // ID或掩码超出范围，或扩展ID表（低延迟ID表）已满
+    return (status == HAL_OK) ? SLCAN_OK : SLCAN_ERR_RANGE;
+}
+
+
+#ifdef PROFILE
+// 解析性能统计命令（非标准，只在PROFILE=1的固件中存在）。周期数为48 MHz的CPU周期：
+//   P       报告各阶段的编号和名称
+//   Pn      报告阶段n的次数和最小/平均/最大周期数
+//   PHn     报告阶段n的直方图：低于64个周期的次数，之后每4倍一档
+//   PC      清空所有阶段的统计
+static int8_t slcan_parse_profile(uint8_t *buf, uint8_t len)
+{
+    char infostr[96] = {0};
+    profile_stats_t stats;
+    uint8_t hist = 0;
+    int32_t stage;
+
+    if (len == 1)
+    {
+        char *p = infostr;
+        for (uint8_t i = 0; i < PROFILE_STAGES; i++)
+        {
+            p += snprintf_(p, infostr + sizeof(infostr) - p, "%u %s ", i, profile_stage_name(i));
+        }
+        p[-1] = '\r';
+        slcan_reply(infostr);
+        return SLCAN_OK;
+    }
+
+    if (buf[1] == 'C')
+    {
+        if (len != 2)
+        {
+            return SLCAN_ERR_LEN;
+        }
+        profile_clear();
+        return SLCAN_OK;
+    }
+
+    if (buf[1] == 'H')
+    {
+        hist = 1;
+        buf++;
+        len--;
+    }
+
+    if (len != 2)
+    {
+        return SLCAN_ERR_LEN;
+    }
+    stage = slcan_hex4(&buf[1], 1);
+    if (stage < 0)
+    {
+        return SLCAN_ERR_HEX;
     }
+    if (stage >= PROFILE_STAGES)
+    {
+        return SLCAN_ERR_RANGE;
+    }
+
+    profile_get_stats(stage, &stats);
+    if (hist)
+    {
+        snprintf_(infostr, sizeof(infostr), "%s H %u %u %u %u %u %u %u %u\r", profile_stage_name(stage),
+                (unsigned int)stats.hist[0], (unsigned int)stats.hist[1], (unsigned int)stats.hist[2], (unsigned int)stats.hist[3],
+                (unsigned int)stats.hist[4], (unsigned int)stats.hist[5], (unsigned int)stats.hist[6], (unsigned int)stats.hist[7]);
+    }
+    else
+    {
+        uint32_t avg = stats.count ? (uint32_t)(stats.sum / stats.count) : 0;
+        snprintf_(infostr, sizeof(infostr), "%s N %u CYC %u/%u/%u\r", profile_stage_name(stage),
+                (unsigned int)stats.count, (unsigned int)(stats.count ? stats.min : 0), (unsigned int)avg, (unsigned int)stats.max);
+    }
+    slcan_reply(infostr);
+    return SLCAN_OK;
+}
+#endif // PROFILE
+
+
+/**
+ * \brief 解析并执行一条slcan命令。
+ *
+ * 这个函数根据slcan协议解释命令字符串。
+ * 它处理各种slcan命令以控制CAN接口或
+ * 提交CAN帧。通常用于USB接口模拟CAN网络接口的场景。
+ *
+ * 先根据命令字符分派，再按命令解析并校验参数：长度必须与命令完全一致，
+ * 十六进制字段每次解码4个字符，ID、DLC和参数必须在范围内。缓冲区不会被修改。
+ *
+ * \param buf 包含slcan命令字符串的缓冲区指针（不含'\r'）。
+ * \param len 命令字符串的长度。
+ *
+ * \return 如果命令成功处理，则返回SLCAN_OK（0）。
+ *         否则返回负的错误码（enum slcan_err）。
+ */
+static int8_t slcan_parse_cmd(uint8_t *buf, uint8_t len)
+{
+	int32_t arg;
 
+	if (len == 0)
+	{
+		return SLCAN_ERR_LEN;
+	}
 
     // 处理命令
     switch(buf[0])  // 根据第一个字符判断命令类型
     {
 		case 'O':
 			// Open channel command
+			if (len != 1)
+			{
+				return SLCAN_ERR_LEN;
+			}
 			can_enable();
-			return 0;
+			return SLCAN_OK;
 
 		case 'C':
 			// Close channel command
+			if (len != 1)
+			{
+				return SLCAN_ERR_LEN;
+			}
 			can_disable();
-			return 0;
+			return SLCAN_OK;
 
 		case 'S':
 			// Set bitrate command
+			arg = slcan_arg(buf, len);
+			if (arg < 0)
+			{
+				return arg;
+			}
 
 			// Check for valid bitrate
-			if(buf[1] >= CAN_BITRATE_INVALID)
+			if(arg >= CAN_BITRATE_INVALID)
 			{
-				return -1;
+				return SLCAN_ERR_RANGE;
 			}
 
-			can_set_bitrate(buf[1]);
-			return 0;
+			can_set_bitrate(arg);
+			return SLCAN_OK;
+
+		case 's':
+			// Set custom bit timing: raw BTR or bitrate plus sample point (nonstandard)
+			return slcan_parse_timing(buf, len);
+
+		case 'D':
+			// Set receive FIFO distribution mode (nonstandard)
+			arg = slcan_arg(buf, len);
+			if (arg < 0)
+			{
+				return arg;
+			}
+
+			// Check for valid mode
+			if(arg >= CAN_FIFO_MODE_INVALID)
+			{
+				return SLCAN_ERR_RANGE;
+			}
+
+			can_set_fifo_mode(arg);
+			return SLCAN_OK;
+
+		case 'f':
+			// Manage the acceptance filter set (nonstandard)
+			return slcan_parse_filter(buf, len);
+
+		case 'B':
+			// Select protocol (nonstandard)
+			// Mode 1: COBS-framed binary records, mode 0: ASCII slcan (default)
+			arg = slcan_arg(buf, len);
+			if (arg < 0)
+			{
+				return arg;
+			}
+			if (arg > 1)
+			{
+				return SLCAN_ERR_RANGE;
+			}
+			binproto_set_enabled(arg);
+			return SLCAN_OK;
+
+		case 'Z':
+			// Set timestamp mode: 0 off, 1 Lawicel milliseconds, 2 microseconds (nonstandard)
+			arg = slcan_arg(buf, len);
+			if (arg < 0)
+			{
+				return arg;
+			}
+
+			if (arg >= SLCAN_TIMESTAMP_INVALID)
+			{
+				return SLCAN_ERR_RANGE;
+			}
+
+			slcan_timestamp_mode = arg;
+			return SLCAN_OK;
+
+		case 'x':
+			// Enable per-frame transmit confirmations (nonstandard)
+			// Mode 1: report xTTR for every transmitted frame, mode 0: off (default)
+			arg = slcan_arg(buf, len);
+			if (arg < 0)
+			{
+				return arg;
+			}
+			can_set_txconf(arg == 1);
+			return SLCAN_OK;
+
+		case 'c':
+			// Credit-based transmit flow control (nonstandard)
+			// Mode 1: report freed transmit queue slots as cNN, starting with all free slots; mode 0: off (default)
+			arg = slcan_arg(buf, len);
+			if (arg < 0)
+			{
+				return arg;
+			}
+			can_set_credits(arg == 1);
+			return SLCAN_OK;
+
+		case 'p':
+			// Set transmit order (nonstandard)
+			// Mode 1: lowest ID first with mailbox preemption, mode 0: arrival order (default)
+			arg = slcan_arg(buf, len);
+			if (arg < 0)
+			{
+				return arg;
+			}
+
+			// Check for valid order
+			if (arg >= CAN_TX_ORDER_INVALID)
+			{
+				return SLCAN_ERR_RANGE;
+			}
+
+			// The order can only change while the channel is closed
+			return (can_set_tx_order(arg) == HAL_OK) ? SLCAN_OK : SLCAN_ERR_BUSY;
+
+		case 'n':
+			// Receive sequence numbers (nonstandard)
+			// Mode 1: append a 4-character sequence number to received frames and report lost frames as lSSSSCCCCCCCCTTTTTTTT, mode 0: off (default)
+			arg = slcan_arg(buf, len);
+			if (arg < 0)
+			{
+				return arg;
+			}
+			can_set_rx_seq(arg == 1);
+			return SLCAN_OK;
+
+		case 'o':
+			// Set receive overload policy (nonstandard)
+			// Mode 0: drop newest (default), mode 1: drop oldest, mode 2: drop by priority
+			arg = slcan_arg(buf, len);
+			if (arg < 0)
+			{
+				return arg;
+			}
+
+			if (arg >= CAN_RX_POLICY_INVALID)
+			{
+				return SLCAN_ERR_RANGE;
+			}
+
+			can_set_rx_policy(arg);
+			return SLCAN_OK;
 
 		case 'm':
 		case 'M':
 			// Set mode command
-			if (buf[1] == 1)
+			arg = slcan_arg(buf, len);
+			if (arg < 0)
+			{
+				return arg;
+			}
+
+			if (arg == 1)
 			{
 				// Mode 1: silent
 				can_set_silent(1);
@@ -172,12 +866,18 @@ int8_t slcan_parse_str(uint8_t *buf, uint8_t len)
 				// Default to normal mode
 				can_set_silent(0);
 			}
-			return 0;
+			return SLCAN_OK;
 
 		case 'a':
 		case 'A':
 			// Set autoretry command
-			if (buf[1] == 1)
+			arg = slcan_arg(buf, len);
+			if (arg < 0)
+			{
+				return arg;
+			}
+
+			if (arg == 1)
 			{
 				// Mode 1: autoretry enabled (default)
 				can_set_autoretransmit(1);
@@ -185,14 +885,14 @@ int8_t slcan_parse_str(uint8_t *buf, uint8_t len)
 				// Mode 0: autoretry disabled
 				can_set_autoretransmit(0);
 			}
-			return 0;
+			return SLCAN_OK;
 
 		case 'V':
 		{
 			// Report firmware version and remote
 			char* fw_id = GIT_VERSION " " GIT_REMOTE "\r";
-			CDC_Transmit_FS((uint8_t*)fw_id, strlen(fw_id));
-			return 0;
+			slcan_reply(fw_id);
+			return SLCAN_OK;
 		}
 
 	    // Nonstandard!
@@ -201,62 +901,97 @@ int8_t slcan_parse_str(uint8_t *buf, uint8_t len)
 	        // Report error register
 			char errstr[64] = {0};
 			snprintf_(errstr, 64, "CANable Error Register: %X", (unsigned int)error_reg());
-			CDC_Transmit_FS((uint8_t*)errstr, strlen(errstr));
-	        return 0;
+			slcan_reply(errstr);
+	        return SLCAN_OK;
 		}
 
-		case 'T':
-	    	frame_header.IDE = CAN_ID_EXT;
-		case 't':
-			// Transmit data frame command
-			frame_header.RTR = CAN_RTR_DATA;
-			break;
+	    // Nonstandard!
+		case 'I':
+		{
+	        // Report receive statistics: frames/overruns per hardware FIFO, frames dropped by the receive queue
+			const can_rxstats_t *stats = can_get_rxstats();
+			char infostr[80] = {0}; // 68 bytes with every counter at its maximum
+			snprintf_(infostr, sizeof(infostr), "RX0 %u/%u RX1 %u/%u DROP %u\r",
+					(unsigned int)stats->frames[0], (unsigned int)stats->overruns[0],
+					(unsigned int)stats->frames[1], (unsigned int)stats->overruns[1],
+					(unsigned int)can_get_rxring()->overflows);
+			slcan_reply(infostr);
+	        return SLCAN_OK;
+		}
 
-		case 'R':
-	    	frame_header.IDE = CAN_ID_EXT;
+		case 'q':
+		{
+			// Report queue statistics: high-water mark/overflows of each ring (nonstandard)
+			const ring_t *canrx = can_get_rxring(), *txconf = can_get_txconfring();
+			const ring_t *usbrx = cdc_get_rxring(), *usbtx = cdc_get_txring();
+			char infostr[96] = {0}; // 94 bytes with every counter at its maximum
+			snprintf_(infostr, sizeof(infostr), "CANRX %u/%u TXCONF %u/%u USBRX %u/%u USBTX %u/%u\r",
+					canrx->high_water, (unsigned int)canrx->overflows,
+					txconf->high_water, (unsigned int)txconf->overflows,
+					usbrx->high_water, (unsigned int)usbrx->overflows,
+					usbtx->high_water, (unsigned int)usbtx->overflows);
+			slcan_reply(infostr);
+			return SLCAN_OK;
+		}
+
+#ifdef PROFILE
+		case 'P':
+			// Report or clear per-stage cycle statistics (nonstandard, PROFILE=1 builds only)
+			return slcan_parse_profile(buf, len);
+#endif
+
+		case 't':
+		case 'T':
 		case 'r':
-			// Transmit remote frame command
-			frame_header.RTR = CAN_RTR_REMOTE;
-			break;
+		case 'R':
+			// Transmit data/remote frame command
+			return slcan_parse_tx(buf, len);
 
     	default:
     		// Error, unknown command
-    		return -1;
+    		return SLCAN_ERR_CMD;
     }
+}
 
 
-    // Save CAN ID depending on ID type
-    uint8_t msg_position = 1;
-    if (frame_header.IDE == CAN_ID_EXT) {
-        while (msg_position <= SLCAN_EXT_ID_LEN) {
-        	frame_header.ExtId *= 16;
-        	frame_header.ExtId += buf[msg_position++];
-        }
-    }
-    else {
-        while (msg_position <= SLCAN_STD_ID_LEN) {
-        	frame_header.StdId *= 16;
-        	frame_header.StdId += buf[msg_position++];
-        }
-    }
-
+/**
+ * \brief 解析通过USB CDC接收的slcan命令字符串，并按Lawicel协议确认。
+ *
+ * 命令失败时回复BEL（'\a'），成功时回复'\r'；有应答的命令（例如V、I）以应答末尾的'\r'作为确认，不再另外回复。
+ * 确认使用收到命令时的协议，因此B0/B1的确认仍按切换前的协议发送。
+ *
+ * \param buf 包含slcan命令字符串的缓冲区指针（不含'\r'）。
+ * \param len 命令字符串的长度。
+ *
+ * \return 如果命令成功处理，则返回SLCAN_OK（0）。
+ *         否则返回负的错误码（enum slcan_err）。
+ */
+int8_t slcan_parse_str(uint8_t *buf, uint8_t len)
+{
+    uint8_t binary = binproto_enabled();
 
-    // Attempt to parse DLC and check sanity
-    frame_header.DLC = buf[msg_position++];
-    if (frame_header.DLC > 8) {
-        return -1;
-    }
+    slcan_replied = 0;
+    int8_t result = slcan_parse_cmd(buf, len);
 
-    // Copy frame data to buffer
-    uint8_t frame_data[8] = {0};
-    for (uint8_t j = 0; j < frame_header.DLC; j++) {
-        frame_data[j] = (buf[msg_position] << 4) + buf[msg_position+1];
-        msg_position += 2;
+    if (result != SLCAN_OK || !slcan_replied)
+    {
+        uint8_t *ack = (uint8_t*)((result == SLCAN_OK) ? "\r" : "\a");
+        if (binary)
+        {
+            binproto_send(BINPROTO_TYPE_TEXT, ack, 1);
+        }
+        else
+        {
+            CDC_Transmit_FS(ack, 1);
+        }
     }
+    return result;
+}
 
-    // Transmit the message
-    can_tx(&frame_header, frame_data);
 
-    return 0;
+// 当前的时间戳模式（enum slcan_timestamp）
+uint8_t slcan_get_timestamp_mode(void)
+{
+    return slcan_timestamp_mode;
 }
 
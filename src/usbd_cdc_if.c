@@ -4,15 +4,22 @@
 
 #include "usbd_cdc_if.h"
 #include "slcan.h"
+#include "binproto.h"
 #include "led.h"
 #include "system.h"
 #include "error.h"
+#include "event.h"
 
 // Private variables
-static volatile usbrx_buf_t rxbuf = {0};
-static uint8_t txbuf[TX_BUF_SIZE];
+static usbrx_buf_t rxbuf = {.ring = RING_INIT(RX_RING_SIZE)};
+static volatile uint8_t rx_paused = 0; // 接收缓冲区放不下三个满包，OUT端点回复NAK，由主循环恢复接收
+static usbtx_buf_t txring = {.ring = RING_INIT(TX_RING_SIZE)};
+_Static_assert(RING_SIZE_OK(RX_RING_SIZE) && RING_SIZE_OK(TX_RING_SIZE), "USB ring sizes must be powers of two");
+_Static_assert(SLCAN_FRAME_MTU <= TX_CLAIM_MAX && BINPROTO_FRAME_MTU <= TX_CLAIM_MAX, "Encoded records must fit into a TX ring claim");
+static uint8_t txring_age = 0; // 未满一包的数据已等待的SOF数，只在USB中断中访问
+static volatile uint16_t txring_flush = 0; // 此位置（自由运行索引）之前的数据立即发送，不等待凑满一包，见cdc_tx_flush
 extern USBD_HandleTypeDef hUsbDeviceFS;
-static uint8_t slcan_str[SLCAN_MTU];
+static uint8_t slcan_str[SLCAN_MTU]; // 跨越两个USB包的命令在这里拼接
 static uint8_t slcan_str_index = 0;
 
 
@@ -21,6 +28,7 @@ static int8_t CDC_Init_FS(void);
 static int8_t CDC_DeInit_FS(void);
 static int8_t CDC_Control_FS(uint8_t cmd, uint8_t* pbuf, uint16_t length);
 static int8_t CDC_Receive_FS(uint8_t* pbuf, uint32_t *Len);
+static int8_t CDC_TransmitCplt_FS(uint8_t* pbuf, uint32_t *Len, uint8_t epnum);
 
 
 // CDC Interface
@@ -29,7 +37,8 @@ USBD_CDC_ItfTypeDef USBD_Interface_fops_FS =
   CDC_Init_FS,
   CDC_DeInit_FS,
   CDC_Control_FS,
-  CDC_Receive_FS
+  CDC_Receive_FS,
+  CDC_TransmitCplt_FS
 };
 
 /* Private functions ---------------------------------------------------------*/
@@ -40,10 +49,11 @@ USBD_CDC_ItfTypeDef USBD_Interface_fops_FS =
 static int8_t CDC_Init_FS(void)
 {
   /* 设置用于发送的缓冲区 */
-  USBD_CDC_SetTxBuffer(&hUsbDeviceFS, txbuf, 0);
+  USBD_CDC_SetTxBuffer(&hUsbDeviceFS, txring.buf, 0);
 
-  /* 设置用于接收的缓冲区 */
-  USBD_CDC_SetRxBuffer(&hUsbDeviceFS, rxbuf.buf[rxbuf.head]);
+  /* 设置用于接收的缓冲区：类驱动随后在这里启动第一次接收 */
+  USBD_CDC_SetRxBuffer(&hUsbDeviceFS, &rxbuf.buf[RING_HEAD(&rxbuf.ring)]);
+  rx_paused = 0;
 
   /* 如果初始化成功，则返回USBD_OK */
   return (USBD_OK);
@@ -117,6 +127,8 @@ static int8_t CDC_Control_FS(uint8_t cmd, uint8_t* pbuf, uint16_t length)
 	break;
 
     case CDC_SET_CONTROL_LINE_STATE:
+    // 主机打开端口时回到ASCII slcan协议，避免上一个程序遗留的二进制模式
+    binproto_set_enabled(0);
     break;
 
     case CDC_SEND_BREAK:
@@ -134,49 +146,87 @@ static int8_t CDC_Control_FS(uint8_t cmd, uint8_t* pbuf, uint16_t length)
  *         通过此函数，通过USB OUT端点接收的数据通过CDC接口发送。
  *
  *         @note
- *         此函数将阻止在退出此函数之前的USB端点上接收任何OUT数据包。
- *         如果在CDC接口上的传输完成之前退出此函数（例如，使用DMA控制器），
- *         结果将接收更多数据，而先前的数据仍未发送。
+ *         OUT端点是双缓冲的：PCD驱动把包复制出来后立即释放它的PMA缓冲区，此时另一个PMA缓冲区可能已经收满，
+ *         硬件还可能正在接收第三个包，端点也不会自动回到NAK。因此每个包之后都把接收位置移到新的head处。
+ *         还能放下三个满包时端点保持有效；否则端点回复NAK，主机暂停发送，由主循环腾出空间后恢复（见cdc_process）。
+ *         回复NAK之前已经收到或已经开始的最多两个包仍然会到达，正好放进留出的两个包的空间。
+ *         暂停期间到达的包同样重新检查并再次设置NAK。因此主机发送得再快也不会丢失数据。
  *
- * @param  Buf: 要接收的数据缓冲区
+ * @param  Buf: 要接收的数据缓冲区（接收缓冲区的head处）
  * @param  Len: 接收到的数据数量（以字节为单位）
- * @retval 操作结果：如果所有操作都OK，则为USBD_OK，否则为USBD_FAIL
+ * @retval 操作结果：USBD_OK
  */
 static int8_t CDC_Receive_FS (uint8_t* Buf, uint32_t *Len)
 {
-    // 检查溢出！
-    // 如果当我们增加头部时，我们将要触及尾部
-    // （如果我们正在填充队列中的最后一个位置）
-    // FIXME: 使用一个“full”变量，而不是浪费一个
-    // cirbuf中的位置，就像我们现在这样做的
-    if( ((rxbuf.head + 1) % NUM_RX_BUFS) == rxbuf.tail)
+    uint16_t end = RING_HEAD(&rxbuf.ring) + *Len;
+
+    // 越过缓冲区末尾的部分搬到开头
+    for (uint16_t i = RX_RING_SIZE; i < end; i++)
     {
-        error_assert(ERR_FULLBUF_USBRX);
+        rxbuf.buf[i - RX_RING_SIZE] = rxbuf.buf[i];
+    }
+    ring_publish(&rxbuf.ring, *Len);
+    event_post(EVENT_USB_RX);
 
-        // 在同一个缓冲区再次监听。旧数据将被覆盖。
-        USBD_CDC_SetRxBuffer(&hUsbDeviceFS, rxbuf.buf[rxbuf.head]);
-        USBD_CDC_ReceivePacket(&hUsbDeviceFS);
-        return HAL_ERROR;
+    // 下一个包总是接收到新的head处
+    USBD_LL_SetRxPosition(&hUsbDeviceFS, CDC_OUT_EP, &rxbuf.buf[RING_HEAD(&rxbuf.ring)]);
+
+    // 空间不足时暂停接收（此时只是暂停，不会丢失数据）。只有从接收状态进入暂停时才由ring_claim计入溢出次数，
+    // 暂停期间到达的包只重新检查空间并再次设置NAK
+    uint8_t full = rx_paused ? (ring_space(&rxbuf.ring) < 3 * RX_BUF_SIZE) : !ring_claim(&rxbuf.ring, 3 * RX_BUF_SIZE);
+    if (full)
+    {
+        rx_paused = 1;
+        USBD_LL_SetRxNak(&hUsbDeviceFS, CDC_OUT_EP, 1);
+    }
+    return (USBD_OK);
+}
+
+// 解析一条完整的命令。buf在解析时会被原地修改。
+static void cdc_parse(uint8_t *buf, uint32_t len, uint8_t binary)
+{
+    // 超长的命令不可能有效，直接丢弃。ASCII模式下与其他无效命令一样回复BEL，无效的二进制记录被忽略
+    if (len > SLCAN_MTU)
+    {
+        if (!binary)
+        {
+            CDC_Transmit_FS((uint8_t*)"\a", 1);
+        }
+        return;
+    }
+
+    // 解析slcan命令字符串或二进制记录。slcan命令（包括二进制文本记录中的命令）由slcan_parse_str按Lawicel协议确认
+    if (binary)
+    {
+        binproto_parse_str(buf, len);
     }
     else
     {
-        // 保存长度
-        rxbuf.msglen[rxbuf.head] = *Len;
-        rxbuf.head = (rxbuf.head + 1) % NUM_RX_BUFS;
-
-        // 开始在下一个缓冲区上监听。先前的缓冲区将在主循环中处理。
-        USBD_CDC_SetRxBuffer(&hUsbDeviceFS, rxbuf.buf[rxbuf.head]);
-        USBD_CDC_ReceivePacket(&hUsbDeviceFS);
-        return (USBD_OK);
+        slcan_parse_str(buf, len);
     }
+}
 
+
+// 把命令片段追加到拼接缓冲区
+static void cdc_stash(uint8_t *buf, uint32_t len)
+{
+    for (uint32_t i = 0; i < len; i++)
+    {
+        // 溢出时重置索引，丢弃之前的片段
+        if (slcan_str_index >= SLCAN_MTU)
+        {
+            slcan_str_index = 0;
+        }
+
+        slcan_str[slcan_str_index++] = buf[i];
+    }
 }
 
+
 /*
  * 函数名称: cdc_process
- * 功能描述: 处理从USB-CDC接口接收的数据。这个函数专注于从RX FIFO（接收缓冲区）中检索数据，
- *           并对这些数据进行处理，以便进行后续的通信或命令执行。它是系统中断驱动通信的重要组成部分，
- *           负责解析接收到的SLCAN协议命令，并做出适当的响应。
+ * 功能描述: 处理从USB-CDC接口接收的数据。每次调用处理接收缓冲区中一段连续的数据（到缓冲区末尾为止），
+ *           解析其中的SLCAN命令或二进制记录。
  * 参数:
  *     无
  *
@@ -184,61 +234,147 @@ static int8_t CDC_Receive_FS (uint8_t* Buf, uint32_t *Len)
  *     无
  *
  * 注意事项:
- *     1. 该函数首先禁用系统中断，以防止在处理接收到的数据时发生中断。这是为了保护数据的完整性
- *        并确保在执行解析和其他操作时不会被其他中断事件打断。
- *     2. 函数检查接收缓冲区是否有数据待处理。如果有，它将处理整个缓冲区的内容，直到遇到消息结束符（本例中为'\r'）。
- *     3. 对于接收到的每个有效消息，函数将尝试解析它作为一个SLCAN协议命令。解析成功或失败时，可以选择性地向USB-CDC发送响应。
- *     4. 该函数还管理一个索引，该索引跟踪SLCAN消息缓冲区中的当前位置，以防止缓冲区溢出。如果检测到溢出，
- *        它将重置索引，并可以选择丢弃当前的消息，等待新的输入。
- *     5. 在处理完当前缓冲区后，函数更新尾指针以移至下一个缓冲区，准备接收更多的数据。
- *     6. 处理完成后，该函数会重新启用系统中断。
+ *     1. 处理过程中中断保持使能。rxbuf是单生产者单消费者队列：USB中断只写head之后的空闲空间，
+ *        主循环只写tail。已发布的数据在释放之前归主循环所有，中断不会改写它。
+ *     2. 完整位于一段连续数据内的命令直接在接收缓冲区中原地解析，不做复制。
+ *     3. 只有跨越数据段末尾（尚未收到的部分或缓冲区末尾）的命令被拼接到slcan_str中：
+ *        前一段末尾的片段先保存下来，下一段中的剩余部分追加到后面再解析。
+ *     4. 处理完后释放这段数据；如果OUT端点因空间不足而暂停，空间足够时恢复接收。
  */
 void cdc_process(void)
 {
-    system_irq_disable(); // 禁用系统中断
+    uint16_t tail = RING_TAIL(&rxbuf.ring);
+    uint32_t len = ring_used(&rxbuf.ring);
 
     // 检查接收缓冲区是否有待处理数据
-    if(rxbuf.tail != rxbuf.head)
+    if (len == 0)
     {
-        // 处理整个缓冲区的内容
-        for (uint32_t i = 0; i < rxbuf.msglen[rxbuf.tail]; i++)
-        {
-            // 如果找到消息终止符（回车符）
-            if (rxbuf.buf[rxbuf.tail][i] == '\r')
-            {
-                // 尝试解析slcan命令字符串
-                int8_t result = slcan_parse_str(slcan_str, slcan_str_index);
+        return;
+    }
+
+    // 只处理到缓冲区末尾，回绕的部分下次处理
+    if (len > RX_RING_SIZE - tail)
+    {
+        len = RX_RING_SIZE - tail;
+    }
+
+    uint8_t *buf = &rxbuf.buf[tail];
+    uint32_t start = 0;
 
-                // 根据解析结果可以发送响应到USB-CDC
-                // 成功
-                //if(result == 0)
-                //    CDC_Transmit_FS("\n", 1); // 发送新行符作为响应
-                // 失败
-                //else
-                //    CDC_Transmit_FS("\a", 1); // 发送警报声
+    // 二进制模式下记录以0x00结束，否则以回车符结束。
+    // 每条命令处理后重新检查，因为协议可能在同一个缓冲区中间被切换。
+    uint8_t binary = binproto_enabled();
 
+    for (uint32_t i = 0; i < len; i++)
+    {
+        // 如果找到消息终止符
+        if (buf[i] == (binary ? 0x00 : '\r'))
+        {
+            if (slcan_str_index)
+            {
+                // 命令的开头在上一个包中
+                cdc_stash(&buf[start], i - start);
+                cdc_parse(slcan_str, slcan_str_index, binary);
                 slcan_str_index = 0; // 重置索引，准备接收新的消息
             }
             else
             {
-                // 检查缓冲区溢出
-                if(slcan_str_index >= SLCAN_MTU)
-                {
-                    // 溢出时重置索引，并可能丢弃当前CDC缓冲区的内容
-                    // TODO: 在此返回并丢弃此CDC缓冲区？
-                    slcan_str_index = 0;
-                }
-
-                // 将字符保存到slcan消息缓冲区中
-                slcan_str[slcan_str_index++] = rxbuf.buf[rxbuf.tail][i];
+                cdc_parse(&buf[start], i - start, binary);
             }
+
+            start = i + 1;
+            binary = binproto_enabled();
         }
+    }
+
+    // 末尾不完整的命令留到下一段数据
+    cdc_stash(&buf[start], len - start);
+
+    // 处理完后释放这段数据，回绕到缓冲区开头的部分留到下一轮
+    ring_release(&rxbuf.ring, len);
+    if (ring_used(&rxbuf.ring))
+    {
+        event_post(EVENT_USB_RX);
+    }
+
+    // OUT端点因空间不足而暂停时，腾出三个满包的空间后恢复接收（与CDC_Receive_FS的判断相同）。接收位置已经在最后一个包之后移到了head处，
+    // 只需要修改端点状态。暂停前已经开始的包可能还没有复制出来，判断和恢复必须与USB中断互斥，因此关中断
+    if (rx_paused)
+    {
+        __disable_irq();
+        if (ring_space(&rxbuf.ring) >= 3 * RX_BUF_SIZE)
+        {
+            rx_paused = 0;
+            USBD_LL_SetRxNak(&hUsbDeviceFS, CDC_OUT_EP, 0);
+        }
+        __enable_irq();
+    }
+}
 
-        // 处理完当前缓冲区后，移动到下一个缓冲区
-        rxbuf.tail = (rxbuf.tail + 1) % NUM_RX_BUFS;
+
+// 检查USB IN端点是否正忙（或设备尚未枚举）
+static uint8_t cdc_tx_busy(void)
+{
+    USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef*)hUsbDeviceFS.pClassData;
+    return (hcdc == NULL) || hcdc->TxState;
+}
+
+
+// 从TX环形缓冲区启动下一个IN包。只在USB中断上下文中调用（或在关中断时由主循环调用）。
+// 满64字节立即发送；不足一包的数据要等到等待时间达到TX_LATENCY_SOF个SOF才发送，除非其中有要求立即发送的数据（cdc_tx_flush）。
+// 包直接从环形缓冲区复制到PMA，不经过中间缓冲区：数据在缓冲区末尾回绕时，先发送到末尾为止的部分，剩下的作为下一个包。
+// 对于不超过一个包的传输，PCD驱动在启动传输时就把数据复制到了PMA，因此发送后可以立即释放环形缓冲区空间。
+static void cdc_tx_kick(void)
+{
+    if (cdc_tx_busy())
+    {
+        return;
+    }
+
+    uint16_t tail = RING_TAIL(&txring.ring);
+    uint16_t used = ring_used(&txring.ring);
+    uint8_t flush = (int16_t)(txring_flush - txring.ring.tail) > 0;
+    if (!flush)
+    {
+        txring_flush = txring.ring.tail; // 已发送过的位置，避免索引回绕后被误认为仍需立即发送
+    }
+    if (used == 0 || (used < TX_BUF_SIZE && txring_age < TX_LATENCY_SOF && !flush))
+    {
+        return;
+    }
+
+    uint16_t len = (used < TX_BUF_SIZE) ? used : TX_BUF_SIZE;
+    if (len > TX_RING_SIZE - tail)
+    {
+        len = TX_RING_SIZE - tail;
     }
 
-    system_irq_enable(); // 重新启用系统中断
+    USBD_CDC_SetTxBuffer(&hUsbDeviceFS, &txring.buf[tail], len);
+    USBD_CDC_TransmitPacket(&hUsbDeviceFS);
+
+    ring_release(&txring.ring, len);
+    txring_age = 0;
+
+    // 主循环可能有因缓冲区已满而留下的记录
+    event_post(EVENT_USB_TX);
+}
+
+
+/**
+ * @brief  CDC_TransmitCplt_FS
+ *         IN传输完成时由USB中断调用，直接链接下一个IN包，主循环不参与发送。
+ *         环形缓冲区中还有数据时（已经开始发送，或者等待SOF凑满一包），这些数据会结束主机的这次读取，
+ *         类驱动不需要在满包之后补发ZLP。只有缓冲区发空时才发送ZLP。
+ *
+ * @param  Buf: 已发送的数据缓冲区
+ * @param  Len: 已发送的数据数量（以字节为单位）
+ * @param  epnum: 端点号
+ * @retval 操作结果：还有数据要发送时为USBD_BUSY，否则为USBD_OK
+ */
+static int8_t CDC_TransmitCplt_FS(uint8_t* Buf, uint32_t *Len, uint8_t epnum)
+{
+    cdc_tx_kick();
+    return ring_used(&txring.ring) ? USBD_BUSY : USBD_OK;
 }
 
 
@@ -246,41 +382,129 @@ void cdc_process(void)
  * @brief  CDC_Transmit_FS
  *         通过此函数，通过USB IN端点发送的数据通过CDC接口发送。
  *         @note
- *
+ *         数据只被追加到TX环形缓冲区，不会等待USB。IN包由USB中断发送：
+ *         上一个包完成时（CDC_TransmitCplt_FS）或每个SOF时（cdc_sof）。
+ *         缓冲区放不下整条消息时丢弃整条消息，不会只发送一部分。
  *
  * @param  Buf: 要发送的数据缓冲区
  * @param  Len: 要发送的数据数量（以字节为单位）
- * @retval 操作结果：如果所有操作都OK，则为USBD_OK，否则为USBD_FAIL或USBD_BUSY
+ * @retval 操作结果：如果所有操作都OK，则为USBD_OK，缓冲区已满则为USBD_BUSY
  */
-// TODO: 在这里进行一些缓冲处理。尝试传输64字节的数据包。
 uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len)
 {
-    // 尝试通过USB进行传输，等待直到不忙
-    // 将来：实现TX缓冲
-    uint32_t start_wait = HAL_GetTick();
-    while( ((USBD_CDC_HandleTypeDef*)hUsbDeviceFS.pClassData)->TxState)
+    uint16_t head = txring.ring.head;
+
+    if (!ring_claim(&txring.ring, Len))
+    {
+        error_assert(ERR_USBTX_BUSY);
+        return USBD_BUSY;
+    }
+
+    for (uint16_t i = 0; i < Len; i++)
+    {
+        txring.buf[(head + i) & (TX_RING_SIZE - 1)] = Buf[i];
+    }
+
+    // 数据写完后才发布
+    ring_publish(&txring.ring, Len);
+    return USBD_OK;
+}
+
+
+/**
+ * @brief  cdc_tx_claim
+ *         在TX环形缓冲区的head处预留len字节的连续空间，编码器直接把记录写到这里，不需要中间缓冲区。
+ *         空间不足时返回NULL，调用者把数据留在原处（例如CAN接收队列），稍后再试，因此不计入溢出次数。
+ *         写入后调用cdc_tx_publish发布实际写入的字节数；不发布则预留的空间不会被使用。只能在主循环中调用。
+ *
+ * @param  len: 预留的字节数，最多TX_CLAIM_MAX
+ * @retval 预留空间的起始地址，空间不足时为NULL
+ */
+uint8_t* cdc_tx_claim(uint16_t len)
+{
+    if (len > TX_CLAIM_MAX || ring_space(&txring.ring) < len)
+    {
+        return NULL;
+    }
+    return &txring.buf[RING_HEAD(&txring.ring)];
+}
+
+
+/**
+ * @brief  cdc_tx_publish
+ *         发布cdc_tx_claim预留的空间中已写入的len字节，USB中断随后把它们发送出去。
+ *
+ * @param  len: 写入的字节数，不超过预留的字节数
+ */
+void cdc_tx_publish(uint16_t len)
+{
+    uint16_t end = RING_HEAD(&txring.ring) + len;
+
+    // 越过缓冲区末尾的部分搬到开头
+    for (uint16_t i = TX_RING_SIZE; i < end; i++)
     {
-      // 如果在超时内没有TX，中止。
-      if(HAL_GetTick() - start_wait >= 10)
-      {
-          error_assert(ERR_USBTX_BUSY);
-          return USBD_BUSY;
-      }
+        txring.buf[i - TX_RING_SIZE] = txring.buf[i];
     }
+    ring_publish(&txring.ring, len);
+}
+
+
+/**
+ * @brief  cdc_tx_flush
+ *         已发布的数据不再等待与后续记录凑满一包：IN端点空闲时立即发送，否则在当前包完成时接着发送。
+ *         用于低延迟ID的接收帧，其他数据仍然凑包发送。只能在主循环中调用。
+ */
+void cdc_tx_flush(void)
+{
+    txring_flush = txring.ring.head;
+
+    // cdc_tx_kick与USB中断中的调用互斥
+    __disable_irq();
+    cdc_tx_kick();
+    __enable_irq();
+}
+
+
+/**
+ * @brief  cdc_tx_space
+ *         TX环形缓冲区的空闲字节数。只能在主循环中调用：主循环是唯一的生产者，返回之后空闲空间只会增加。
+ */
+uint16_t cdc_tx_space(void)
+{
+    return ring_space(&txring.ring);
+}
+
 
-    // 确保消息将适合缓冲区
-    if(Len > TX_BUF_SIZE)
+/**
+ * @brief  cdc_sof
+ *         在每个USB SOF（1 ms）时由USB中断调用。累计未满一包的数据的等待时间，
+ *         并在IN端点空闲时启动发送（例如一串数据的第一个包），从而限制低负载时的延迟。
+ */
+void cdc_sof(void)
+{
+    if (ring_used(&txring.ring) == 0)
     {
-    	return 0;
+        return;
     }
 
-    // 将数据复制到缓冲区
-    for (uint32_t i=0; i < Len; i++)
+    if (txring_age < TX_LATENCY_SOF)
     {
-    	txbuf[i] = Buf[i];
+        txring_age++;
     }
 
-    // 设置传输缓冲区并开始TX
-    USBD_CDC_SetTxBuffer(&hUsbDeviceFS, txbuf, Len);
-    return USBD_CDC_TransmitPacket(&hUsbDeviceFS);
+    cdc_tx_kick();
+}
+
+
+// 获取USB接收缓冲区的环形索引（最高水位和溢出次数）
+const ring_t* cdc_get_rxring(void)
+{
+    return &rxbuf.ring;
+}
+
+
+// 获取USB发送环形缓冲区的环形索引（最高水位和溢出次数）
+const ring_t* cdc_get_txring(void)
+{
+    return &txring.ring;
 }
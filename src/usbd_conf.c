@@ -22,6 +22,7 @@
 #include "usbd_def.h"
 #include "usbd_core.h"
 #include "usbd_cdc.h"
+#include "usbd_cdc_if.h"
 #include "system.h"
 
 /* USER CODE BEGIN Includes */
@@ -30,6 +31,29 @@
 
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
+
+// PMA（USB包缓冲区存储器，1 KB）布局，单位为字节地址。开头是缓冲区描述表，端点0到PMA_EP_COUNT-1各占8字节，
+// 之后按端点的最大包大小依次排列各个缓冲区。双缓冲端点占两个缓冲区。
+#define PMA_SIZE      1024
+#define PMA_EP_COUNT  4 // 使用的端点寄存器数：EP0、CDC数据IN、CDC命令、CDC数据OUT
+#define PMA_EP0_OUT   (PMA_EP_COUNT * 8)
+#define PMA_EP0_IN    (PMA_EP0_OUT + USB_MAX_EP0_SIZE)
+#define PMA_CDC_CMD   (PMA_EP0_IN + USB_MAX_EP0_SIZE)
+#define PMA_CDC_IN    (PMA_CDC_CMD + CDC_CMD_PACKET_SIZE)
+#define PMA_CDC_OUT0  (PMA_CDC_IN + CDC_DATA_FS_IN_PACKET_SIZE)
+#define PMA_CDC_OUT1  (PMA_CDC_OUT0 + CDC_DATA_FS_OUT_PACKET_SIZE)
+#define PMA_END       (PMA_CDC_OUT1 + CDC_DATA_FS_OUT_PACKET_SIZE)
+
+// CDC数据OUT端点使用端点寄存器3。双缓冲端点占用寄存器的两个缓冲区描述符，不能与CDC数据IN端点共用寄存器1。
+// 硬件按寄存器的EA字段匹配端点地址，与寄存器编号无关，因此主机看到的地址仍是CDC_OUT_EP，只有PCD使用寄存器编号。
+#define CDC_OUT_EP_REG 0x03U
+
+_Static_assert(PMA_END <= PMA_SIZE, "Endpoint buffers do not fit into the PMA");
+_Static_assert((CDC_IN_EP & 0x0F) < PMA_EP_COUNT && CDC_OUT_EP_REG < PMA_EP_COUNT && (CDC_CMD_EP & 0x0F) < PMA_EP_COUNT, "Endpoint number outside the buffer descriptor table");
+_Static_assert(CDC_OUT_EP_REG != 0 && CDC_OUT_EP_REG != (CDC_IN_EP & 0x0F) && CDC_OUT_EP_REG != (CDC_CMD_EP & 0x0F), "A double-buffered endpoint needs an endpoint register of its own");
+_Static_assert(((USB_MAX_EP0_SIZE | CDC_CMD_PACKET_SIZE | CDC_DATA_FS_IN_PACKET_SIZE) & 1) == 0, "PMA buffers must be 16-bit aligned");
+_Static_assert((CDC_DATA_FS_OUT_PACKET_SIZE & 31) == 0, "OUT buffers over 62 bytes are allocated in 32-byte blocks");
+
 /* Private macro -------------------------------------------------------------*/
 
 /* USER CODE BEGIN PV */
@@ -52,6 +76,12 @@ PCD_HandleTypeDef hpcd_USB_FS;
 
 /* USER CODE BEGIN 1 */
 static void SystemClockConfig_Resume(void);
+
+// USB设备库的端点地址转换为PCD的端点编号（端点寄存器），只有CDC数据OUT端点不同
+static uint8_t pcd_ep(uint8_t ep_addr)
+{
+  return (ep_addr == CDC_OUT_EP) ? CDC_OUT_EP_REG : ep_addr;
+}
 /* USER CODE END 1 */
 void HAL_PCDEx_SetConnectionState(PCD_HandleTypeDef *hpcd, uint8_t state);
 extern void SystemClock_Config(void);
@@ -118,7 +148,10 @@ void HAL_PCD_SetupStageCallback(PCD_HandleTypeDef *hpcd)
   */
 void HAL_PCD_DataOutStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum)
 {
-  USBD_LL_DataOutStage((USBD_HandleTypeDef*)hpcd->pData, epnum, hpcd->OUT_ep[epnum].xfer_buff);
+  // 端点寄存器编号转换回USB设备库的端点地址
+  uint8_t ep_addr = (epnum == CDC_OUT_EP_REG) ? CDC_OUT_EP : epnum;
+
+  USBD_LL_DataOutStage((USBD_HandleTypeDef*)hpcd->pData, ep_addr, hpcd->OUT_ep[epnum].xfer_buff);
 }
 
 /**
@@ -140,6 +173,9 @@ void HAL_PCD_DataInStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum)
 void HAL_PCD_SOFCallback(PCD_HandleTypeDef *hpcd)
 {
   USBD_LL_SOF((USBD_HandleTypeDef*)hpcd->pData);
+
+  /* 发送已达到延迟上限的暂存CDC数据 */
+  cdc_sof();
 }
 
 /**
@@ -281,12 +317,13 @@ USBD_StatusTypeDef USBD_LL_Init(USBD_HandleTypeDef *pdev)
 //    _Error_Handler(__FILE__, __LINE__);  // 调用错误处理函数（这里被注释掉了）
   }
 
-  // 配置USB设备的物理内存区域
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x00 , PCD_SNG_BUF, 0x18);  // 端点0配置
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x80 , PCD_SNG_BUF, 0x58);  // 端点1配置
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x81 , PCD_SNG_BUF, 0xC0);  // 端点2配置
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x01 , PCD_SNG_BUF, 0x110);  // 端点3配置
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x82 , PCD_SNG_BUF, 0x100);  // 端点4配置
+  // 配置USB设备的物理内存区域。CDC数据OUT端点使用双缓冲：硬件接收到一个缓冲区时，另一个缓冲区可以同时交给软件，
+  // 主机不必等待固件重新使能端点就能在同一帧内连续发送。
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x00 , PCD_SNG_BUF, PMA_EP0_OUT);  // 端点0 OUT
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x80 , PCD_SNG_BUF, PMA_EP0_IN);  // 端点0 IN
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , CDC_IN_EP , PCD_SNG_BUF, PMA_CDC_IN);  // CDC数据IN
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , CDC_CMD_EP , PCD_SNG_BUF, PMA_CDC_CMD);  // CDC命令IN
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , CDC_OUT_EP_REG , PCD_DBL_BUF, (PMA_CDC_OUT1 << 16) | PMA_CDC_OUT0);  // CDC数据OUT（双缓冲）
 
   return USBD_OK;  // 函数执行成功，返回OK状态
 }
@@ -403,7 +440,15 @@ USBD_StatusTypeDef USBD_LL_OpenEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr, uin
   HAL_StatusTypeDef hal_status = HAL_OK;
   USBD_StatusTypeDef usb_status = USBD_OK;
 
-  hal_status = HAL_PCD_EP_Open(pdev->pData, ep_addr, ep_mps, ep_type);
+  hal_status = HAL_PCD_EP_Open(pdev->pData, pcd_ep(ep_addr), ep_mps, ep_type);
+
+  // PCD把端点寄存器编号写入EA字段，CDC数据OUT端点的寄存器改为响应主机看到的地址
+  if (ep_addr == CDC_OUT_EP)
+  {
+    USB_TypeDef *usb = ((PCD_HandleTypeDef*)pdev->pData)->Instance;
+    PCD_SET_ENDPOINT(usb, CDC_OUT_EP_REG, (PCD_GET_ENDPOINT(usb, CDC_OUT_EP_REG) & USB_EPREG_MASK & ~USB_EPADDR_FIELD) |
+                     CDC_OUT_EP | USB_EP_CTR_RX | USB_EP_CTR_TX);
+  }
 
   switch (hal_status) {
     case HAL_OK :
@@ -436,7 +481,7 @@ USBD_StatusTypeDef USBD_LL_CloseEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
   HAL_StatusTypeDef hal_status = HAL_OK;
   USBD_StatusTypeDef usb_status = USBD_OK;
   
-  hal_status = HAL_PCD_EP_Close(pdev->pData, ep_addr);
+  hal_status = HAL_PCD_EP_Close(pdev->pData, pcd_ep(ep_addr));
       
   switch (hal_status) {
     case HAL_OK :
@@ -469,7 +514,7 @@ USBD_StatusTypeDef USBD_LL_FlushEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
   HAL_StatusTypeDef hal_status = HAL_OK;
   USBD_StatusTypeDef usb_status = USBD_OK;
   
-  hal_status = HAL_PCD_EP_Flush(pdev->pData, ep_addr);
+  hal_status = HAL_PCD_EP_Flush(pdev->pData, pcd_ep(ep_addr));
       
   switch (hal_status) {
     case HAL_OK :
@@ -502,7 +547,7 @@ USBD_StatusTypeDef USBD_LL_StallEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
   HAL_StatusTypeDef hal_status = HAL_OK;
   USBD_StatusTypeDef usb_status = USBD_OK;
   
-  hal_status = HAL_PCD_EP_SetStall(pdev->pData, ep_addr);
+  hal_status = HAL_PCD_EP_SetStall(pdev->pData, pcd_ep(ep_addr));
 
   switch (hal_status) {
     case HAL_OK :
@@ -535,7 +580,7 @@ USBD_StatusTypeDef USBD_LL_ClearStallEP(USBD_HandleTypeDef *pdev, uint8_t ep_add
   HAL_StatusTypeDef hal_status = HAL_OK;
   USBD_StatusTypeDef usb_status = USBD_OK;
   
-  hal_status = HAL_PCD_EP_ClrStall(pdev->pData, ep_addr);  
+  hal_status = HAL_PCD_EP_ClrStall(pdev->pData, pcd_ep(ep_addr));  
      
   switch (hal_status) {
     case HAL_OK :
@@ -573,7 +618,7 @@ uint8_t USBD_LL_IsStallEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
   }
   else
   {
-    return hpcd->OUT_ep[ep_addr & 0x7F].is_stall; 
+    return hpcd->OUT_ep[pcd_ep(ep_addr) & 0x7F].is_stall; 
   }
 }
 
@@ -660,7 +705,7 @@ USBD_StatusTypeDef USBD_LL_PrepareReceive(USBD_HandleTypeDef *pdev, uint8_t ep_a
   HAL_StatusTypeDef hal_status = HAL_OK;
   USBD_StatusTypeDef usb_status = USBD_OK;
 
-  hal_status = HAL_PCD_EP_Receive(pdev->pData, ep_addr, pbuf, size);
+  hal_status = HAL_PCD_EP_Receive(pdev->pData, pcd_ep(ep_addr), pbuf, size);
      
   switch (hal_status) {
     case HAL_OK :
@@ -690,7 +735,39 @@ USBD_StatusTypeDef USBD_LL_PrepareReceive(USBD_HandleTypeDef *pdev, uint8_t ep_a
   */
 uint32_t USBD_LL_GetRxDataSize(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
 {
-  return HAL_PCD_EP_GetRxCount((PCD_HandleTypeDef*) pdev->pData, ep_addr);
+  return HAL_PCD_EP_GetRxCount((PCD_HandleTypeDef*) pdev->pData, pcd_ep(ep_addr));
+}
+
+/**
+  * @brief  设置双缓冲OUT端点的下一个包的接收位置。
+  *         硬件此时可能正在接收到另一个缓冲区，因此只修改PCD中的接收位置，不改写缓冲区描述符
+  *         （USBD_LL_PrepareReceive会重写两个缓冲区的计数，可能覆盖刚收到的包的长度）。
+  *         必须在USB中断中或关中断时调用。
+  * @param  pdev: 设备句柄
+  * @param  ep_addr: 端点地址
+  * @param  pbuf: 下一个包的接收位置，至少能容纳一个满包
+  * @retval 无
+  */
+void USBD_LL_SetRxPosition(USBD_HandleTypeDef *pdev, uint8_t ep_addr, uint8_t *pbuf)
+{
+  PCD_EPTypeDef *ep = &((PCD_HandleTypeDef*)pdev->pData)->OUT_ep[pcd_ep(ep_addr) & 0x7FU];
+
+  ep->xfer_buff = pbuf;
+  ep->xfer_len = 0U; // 每个包都作为一次完整的传输交给类驱动
+  ep->xfer_count = 0U;
+}
+
+/**
+  * @brief  使OUT端点回复NAK（主机暂停发送）或重新接收。
+  *         双缓冲端点收到包后不会自动回到NAK，流量控制只能由软件设置端点状态。
+  * @param  pdev: 设备句柄
+  * @param  ep_addr: 端点地址
+  * @param  nak: 1为回复NAK，0为重新接收
+  * @retval 无
+  */
+void USBD_LL_SetRxNak(USBD_HandleTypeDef *pdev, uint8_t ep_addr, uint8_t nak)
+{
+  PCD_SET_EP_RX_STATUS(((PCD_HandleTypeDef*)pdev->pData)->Instance, pcd_ep(ep_addr) & 0x7FU, nak ? USB_EP_RX_NAK : USB_EP_RX_VALID);
 }
 
 /**
@@ -0,0 +1,138 @@
+//
+// Host test: a mailbox aborted for preemption while it still carries ALSTx must be requeued,
+// not reported as lost arbitration. can.c is compiled against RAM copies of the peripherals,
+// the real HAL CAN driver (linked separately) decodes TSR and calls the callbacks.
+//
+
+#include <stdio.h>
+#include "stm32f0xx_hal.h"
+
+static CAN_TypeDef test_can;
+static TIM_TypeDef test_tim2;
+static RCC_TypeDef test_rcc;
+#undef CAN
+#undef TIM2
+#undef RCC
+#define CAN (&test_can)
+#define TIM2 (&test_tim2)
+#define RCC (&test_rcc)
+#undef __disable_irq
+#undef __enable_irq
+#undef __DMB
+#define __disable_irq() ((void)0)
+#define __enable_irq() ((void)0)
+#define __DMB() ((void)0)
+
+#include "../src/ring.c"
+#include "../src/can.c"
+
+// Stubs for the rest of the firmware
+void HAL_GPIO_Init(GPIO_TypeDef *gpio, GPIO_InitTypeDef *init) {}
+void HAL_NVIC_SetPriority(IRQn_Type irq, uint32_t prio, uint32_t sub) {}
+void HAL_NVIC_EnableIRQ(IRQn_Type irq) {}
+uint32_t HAL_RCC_GetPCLK1Freq(void) { return 48000000; }
+uint32_t HAL_GetTick(void) { return 0; }
+void led_green_on(void) {}
+void led_blue_on(void) {}
+void error_assert(error_t err) {}
+void event_post(uint32_t events) {}
+void filter_apply(void) {}
+void filter_set_fifo_mode(enum can_fifo_mode mode) {}
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+// TSR with the given mailboxes empty; CODE points at the lowest empty one
+static uint32_t tsr_empty(uint8_t mask)
+{
+    uint32_t tsr = (uint32_t)mask << CAN_TSR_TME0_Pos;
+    for (uint8_t m = 0; m < 3; m++)
+    {
+        if (mask & (1 << m))
+        {
+            return tsr | ((uint32_t)m << CAN_TSR_CODE_Pos);
+        }
+    }
+    return tsr;
+}
+
+static void queue_std(uint32_t id, uint8_t tag)
+{
+    CAN_TxHeaderTypeDef hdr = {0};
+    uint8_t data[8] = {0};
+    hdr.StdId = id;
+    hdr.IDE = CAN_ID_STD;
+    hdr.RTR = CAN_RTR_DATA;
+    hdr.DLC = 0;
+    CHECK(can_tx(&hdr, data, tag) == HAL_OK);
+}
+
+static uint32_t mailbox_id(uint8_t m)
+{
+    return test_can.sTxMailBox[m].TIR >> CAN_TI0R_STID_Pos;
+}
+
+// Mailbox m finished with the given TSR status bits; run the interrupt as CEC_CAN_IRQHandler does
+static void mailbox_finish(uint8_t m, uint32_t status)
+{
+    test_can.TSR = (CAN_TSR_RQCP0 | status) << (8 * m);
+    HAL_CAN_IRQHandler(&can_handle);
+    test_can.TSR = 0;
+}
+
+static uint32_t queued_id(uint8_t slot)
+{
+    return txqueue.frame[slot].tir >> CAN_TI0R_STID_Pos;
+}
+
+int main(void)
+{
+    can_txconf_t conf;
+
+    can_init();
+    CHECK(can_set_tx_order(CAN_TX_ORDER_PRIORITY) == HAL_OK);
+    can_set_txconf(1);
+    bus_state = ON_BUS;
+    can_handle.State = HAL_CAN_STATE_LISTENING;
+    test_can.IER = CAN_IT_TX_MAILBOX_EMPTY;
+
+    // Fill the three mailboxes with low-priority frames, one at a time so TSR.CODE follows
+    test_can.TSR = tsr_empty(0x7);
+    queue_std(0x700, 1);
+    can_process();
+    test_can.TSR = tsr_empty(0x6);
+    queue_std(0x701, 2);
+    can_process();
+    test_can.TSR = tsr_empty(0x4);
+    queue_std(0x702, 3);
+    can_process();
+    test_can.TSR = tsr_empty(0);
+    CHECK(mailbox_id(0) == 0x700 && mailbox_id(1) == 0x701 && mailbox_id(2) == 0x702);
+
+    // An urgent frame preempts the lowest-priority mailbox
+    queue_std(0x100, 4);
+    can_process();
+    CHECK(test_can.TSR == CAN_TSR_ABRQ2);
+
+    // The abort completes while mailbox 2 still has ALST2 set from its last arbitration attempt:
+    // the frame goes back to the queue behind the urgent one, nothing is reported to the host
+    mailbox_finish(2, CAN_TSR_ALST0);
+    CHECK(can_txconf_rx(&conf) == HAL_ERROR);
+    CHECK(mailbox_slot[2] == TXQUEUE_NONE);
+    CHECK(mailbox_preempt == 0);
+    CHECK(txqueue.count == 4);
+    CHECK(txqueue.head != TXQUEUE_NONE && queued_id(txqueue.head) == 0x100);
+    CHECK(txqueue.next[txqueue.head] != TXQUEUE_NONE && queued_id(txqueue.next[txqueue.head]) == 0x702);
+
+    // A mailbox that was not preempted still reports lost arbitration, and a normal completion still reports success
+    mailbox_finish(0, CAN_TSR_ALST0);
+    CHECK(can_txconf_rx(&conf) == HAL_OK && conf.tag == 1 && conf.result == CAN_TXCONF_ARB_LOST);
+    mailbox_finish(1, CAN_TSR_TXOK0);
+    CHECK(can_txconf_rx(&conf) == HAL_OK && conf.tag == 2 && conf.result == CAN_TXCONF_OK);
+    CHECK(can_txconf_rx(&conf) == HAL_ERROR);
+    CHECK(txqueue.count == 2);
+
+    printf(failures ? "can_preempt_test: %d failures\n" : "can_preempt_test: ok\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,181 @@
+//
+// Host test: the bit-timing solver at the 8, 16 and 48 MHz PCLK of the supported builds.
+// Every result is decoded back from BTR and checked against the register limits, and the bitrate
+// and sample point errors are compared with a brute-force search over all prescaler/quanta pairs.
+//
+
+#include <stdio.h>
+#include "stm32f0xx_hal.h"
+
+static CAN_TypeDef test_can;
+static TIM_TypeDef test_tim2;
+static RCC_TypeDef test_rcc;
+#undef CAN
+#undef TIM2
+#undef RCC
+#define CAN (&test_can)
+#define TIM2 (&test_tim2)
+#define RCC (&test_rcc)
+#undef __disable_irq
+#undef __enable_irq
+#undef __DMB
+#define __disable_irq() ((void)0)
+#define __enable_irq() ((void)0)
+#define __DMB() ((void)0)
+
+#include "../src/ring.c"
+#include "../src/can.c"
+
+static uint32_t test_pclk;
+
+// Stubs for the rest of the firmware
+void HAL_GPIO_Init(GPIO_TypeDef *gpio, GPIO_InitTypeDef *init) {}
+void HAL_NVIC_SetPriority(IRQn_Type irq, uint32_t prio, uint32_t sub) {}
+void HAL_NVIC_EnableIRQ(IRQn_Type irq) {}
+uint32_t HAL_RCC_GetPCLK1Freq(void) { return test_pclk; }
+uint32_t HAL_GetTick(void) { return 0; }
+void led_green_on(void) {}
+void led_blue_on(void) {}
+void error_assert(error_t err) {}
+void event_post(uint32_t events) {}
+void filter_apply(void) {}
+void filter_set_fifo_mode(enum can_fifo_mode mode) {}
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL %s:%d: %s (pclk %u, bitrate %u)\n", __FILE__, __LINE__, #cond, \
+                                               (unsigned)test_pclk, (unsigned)bitrate); failures++; } } while (0)
+
+static uint32_t diff(uint32_t a, uint32_t b)
+{
+    return (a > b) ? a - b : b - a;
+}
+
+// Best bitrate error in clock cycles over every prescaler and 8-25 quanta per bit, and the best
+// sample point error among the quanta counts that reach it. TS1 is at most 16 quanta and TS2 2-8.
+static void reference(uint32_t bitrate, uint32_t sample_point, uint32_t *rate_err, uint32_t *sp_err)
+{
+    *rate_err = UINT32_MAX;
+    *sp_err = UINT32_MAX;
+    for (uint32_t ntq = CAN_TQ_MIN; ntq <= CAN_TQ_MAX; ntq++)
+    {
+        uint32_t best_sp = UINT32_MAX;
+        for (uint32_t ts2 = CAN_TS2_MIN; ts2 <= CAN_TS2_MAX; ts2++)
+        {
+            uint32_t ts1 = ntq - 1 - ts2;
+            if (ts1 >= 1 && ts1 <= CAN_TS1_MAX && diff((1 + ts1) * 1000 / ntq, sample_point) < best_sp)
+            {
+                best_sp = diff((1 + ts1) * 1000 / ntq, sample_point);
+            }
+        }
+
+        for (uint32_t brp = 1; brp <= CAN_BRP_MAX; brp++)
+        {
+            uint64_t actual = (uint64_t)brp * ntq * bitrate;
+            uint64_t err64 = (actual > test_pclk) ? actual - test_pclk : test_pclk - actual;
+            uint32_t err = (err64 > UINT32_MAX) ? UINT32_MAX : (uint32_t)err64;
+            if (err < *rate_err || (err == *rate_err && best_sp < *sp_err))
+            {
+                *rate_err = err;
+                *sp_err = best_sp;
+            }
+        }
+    }
+}
+
+// Solve and check the result; returns the bitrate error in clock cycles, or UINT32_MAX if there was no solution
+static uint32_t check_solve(uint32_t bitrate, uint32_t sample_point)
+{
+    uint32_t btr = 0xdeadbeef;
+    uint32_t best, best_sp;
+    reference(bitrate, sample_point, &best, &best_sp);
+
+    if (can_solve_timing(bitrate, sample_point, &btr) != HAL_OK)
+    {
+        CHECK(btr == 0xdeadbeef);
+        CHECK(best > test_pclk / 200);
+        return UINT32_MAX;
+    }
+
+    uint32_t brp = ((btr & CAN_BTR_BRP_Msk) >> CAN_BTR_BRP_Pos) + 1;
+    uint32_t ts1 = ((btr & CAN_BTR_TS1_Msk) >> CAN_BTR_TS1_Pos) + 1;
+    uint32_t ts2 = ((btr & CAN_BTR_TS2_Msk) >> CAN_BTR_TS2_Pos) + 1;
+    uint32_t sjw = ((btr & CAN_BTR_SJW_Msk) >> CAN_BTR_SJW_Pos) + 1;
+    uint32_t ntq = 1 + ts1 + ts2;
+
+    CHECK((btr & ~(CAN_BTR_BRP_Msk | CAN_BTR_TS1_Msk | CAN_BTR_TS2_Msk | CAN_BTR_SJW_Msk)) == 0);
+    CHECK(ntq >= CAN_TQ_MIN && ntq <= CAN_TQ_MAX);
+    CHECK(ts2 >= CAN_TS2_MIN);
+    CHECK(sjw == ((ts2 < CAN_SJW_MAX) ? ts2 : CAN_SJW_MAX));
+
+    uint32_t err = diff(brp * ntq * bitrate, test_pclk);
+    CHECK(err <= test_pclk / 200);
+    CHECK(err == best);
+    CHECK(diff((1 + ts1) * 1000 / ntq, sample_point) == best_sp);
+    return err;
+}
+
+int main(void)
+{
+    static const uint32_t clocks[] = { 8000000, 16000000, 48000000 };
+
+    for (uint8_t c = 0; c < sizeof(clocks) / sizeof(clocks[0]); c++)
+    {
+        uint32_t bitrate;
+        test_pclk = clocks[c];
+
+        // Every preset is exact, except 750k which has no solution below 48 MHz
+        for (uint8_t p = 0; p < CAN_BITRATE_INVALID; p++)
+        {
+            bitrate = bitrate_preset[p];
+            uint32_t err = check_solve(bitrate, CAN_SAMPLE_POINT_DEFAULT);
+            if (bitrate == 750000 && test_pclk != 48000000)
+            {
+                CHECK(err == UINT32_MAX);
+            }
+            else
+            {
+                CHECK(err == 0);
+            }
+        }
+
+        // 33.3k and 83.3k within 0.01%
+        bitrate = 33333;
+        CHECK(check_solve(bitrate, CAN_SAMPLE_POINT_DEFAULT) <= test_pclk / 10000);
+        bitrate = 83333;
+        CHECK(check_solve(bitrate, CAN_SAMPLE_POINT_DEFAULT) <= test_pclk / 10000);
+
+        // Other sample points
+        for (uint32_t sp = 500; sp <= 900; sp += 25)
+        {
+            bitrate = 500000;
+            check_solve(bitrate, sp);
+        }
+
+        // Sweep the whole range: the solver finds the smallest error, or rejects when it exceeds 0.5%
+        for (bitrate = 5000; bitrate <= 1000000; bitrate += 997)
+        {
+            check_solve(bitrate, CAN_SAMPLE_POINT_DEFAULT);
+        }
+
+        // Invalid arguments
+        uint32_t btr = 0;
+        bitrate = 0;
+        CHECK(can_solve_timing(0, CAN_SAMPLE_POINT_DEFAULT, &btr) == HAL_ERROR);
+        bitrate = 500000;
+        CHECK(can_solve_timing(bitrate, 0, &btr) == HAL_ERROR);
+        CHECK(can_solve_timing(bitrate, 1000, &btr) == HAL_ERROR);
+        CHECK(btr == 0);
+    }
+
+    // A rejected bitrate leaves the current timing alone
+    uint32_t bitrate = 750000;
+    test_pclk = 16000000;
+    can_set_bitrate(CAN_BITRATE_500K);
+    uint32_t before = bit_timing;
+    CHECK(can_set_bittiming(bitrate, CAN_SAMPLE_POINT_DEFAULT) == HAL_ERROR);
+    CHECK(bit_timing == before);
+
+    printf(failures ? "can_timing_test: %d failures\n" : "can_timing_test: ok\n", failures);
+    return failures != 0;
+}
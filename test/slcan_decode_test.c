@@ -0,0 +1,162 @@
+//
+// Host test: the SWAR hex decoder slcan_hex4 against a scalar reference, and valid and
+// malformed t/T/r/R commands through slcan_parse_str, including the CR/BEL acknowledgement.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include "stm32f0xx_hal.h"
+#include "slcan_stubs.h"
+
+#include "../src/slcan.c"
+
+// printf.h maps this to the firmware printf; the report uses the C library
+#undef printf
+
+#define RANDOM_STRINGS 2000000
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+// xorshift32, fixed seed so failures are reproducible
+static uint32_t rng_state = 88172645UL;
+static uint32_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+// One character at a time, as the original decoder did
+static int32_t hex_reference(const uint8_t *p, uint8_t n)
+{
+    int32_t val = 0;
+    for (uint8_t i = 0; i < n; i++)
+    {
+        uint8_t c = p[i];
+        if (c >= '0' && c <= '9')
+        {
+            val = (val << 4) | (c - '0');
+        }
+        else if (c >= 'A' && c <= 'F')
+        {
+            val = (val << 4) | (c - 'A' + 10);
+        }
+        else if (c >= 'a' && c <= 'f')
+        {
+            val = (val << 4) | (c - 'a' + 10);
+        }
+        else
+        {
+            return -1;
+        }
+    }
+    return val;
+}
+
+static void check_hex(const uint8_t *p, uint8_t n)
+{
+    int32_t got = slcan_hex4(p, n);
+    int32_t want = hex_reference(p, n);
+    if (got != want)
+    {
+        if (failures++ < 5)
+        {
+            printf("FAIL slcan_hex4(\"%.*s\", %u) = %d, want %d\n", n, p, n, (int)got, (int)want);
+        }
+    }
+}
+
+// Mostly hex characters, with neighbours of the valid ranges and arbitrary bytes mixed in
+static uint8_t random_char(void)
+{
+    static const char pool[] = "0123456789abcdefABCDEF/:@G`g\x7f\x80\xff\x00 ";
+    uint32_t r = rng();
+    return (r & 0x100) ? (uint8_t)r : (uint8_t)pool[r % (sizeof(pool) - 1)];
+}
+
+// Run one command through slcan_parse_str; returns the result and checks the acknowledgement
+static int8_t command(const char *cmd)
+{
+    stub_tx_count = 0;
+    stub_cdc_len = 0;
+    int8_t result = slcan_parse_str((uint8_t*)cmd, strlen(cmd));
+    CHECK(stub_cdc_len == 1 && stub_cdc_out[0] == ((result == SLCAN_OK) ? '\r' : '\a'));
+    CHECK(stub_tx_count == (result == SLCAN_OK));
+    return result;
+}
+
+int main(void)
+{
+    uint8_t s[4];
+
+    // Every single character, then every pair
+    for (uint32_t a = 0; a < 256; a++)
+    {
+        s[0] = a;
+        check_hex(s, 1);
+        for (uint32_t b = 0; b < 256; b++)
+        {
+            s[1] = b;
+            check_hex(s, 2);
+        }
+    }
+
+    // Random strings of 1-4 characters
+    for (uint32_t i = 0; i < RANDOM_STRINGS; i++)
+    {
+        uint8_t n = 1 + rng() % 4;
+        for (uint8_t k = 0; k < n; k++)
+        {
+            s[k] = random_char();
+        }
+        check_hex(s, n);
+    }
+
+    // Valid transmit commands
+    CHECK(command("t1232AABB") == SLCAN_OK);
+    CHECK(stub_tx_header.IDE == CAN_ID_STD && stub_tx_header.StdId == 0x123 && stub_tx_header.RTR == CAN_RTR_DATA);
+    CHECK(stub_tx_header.DLC == 2 && stub_tx_data[0] == 0xAA && stub_tx_data[1] == 0xBB && stub_tx_tag == 0);
+
+    CHECK(command("T1fffFFff81122334455667788") == SLCAN_OK);
+    CHECK(stub_tx_header.IDE == CAN_ID_EXT && stub_tx_header.ExtId == 0x1FFFFFFF && stub_tx_header.DLC == 8);
+    CHECK(stub_tx_data[0] == 0x11 && stub_tx_data[7] == 0x88);
+
+    CHECK(command("t7FF0") == SLCAN_OK);
+    CHECK(stub_tx_header.StdId == 0x7FF && stub_tx_header.DLC == 0);
+
+    CHECK(command("r0018") == SLCAN_OK);
+    CHECK(stub_tx_header.RTR == CAN_RTR_REMOTE && stub_tx_header.StdId == 0x001 && stub_tx_header.DLC == 8);
+
+    CHECK(command("R123456784") == SLCAN_OK);
+    CHECK(stub_tx_header.RTR == CAN_RTR_REMOTE && stub_tx_header.ExtId == 0x12345678 && stub_tx_header.DLC == 4);
+
+    // Optional tag (transmit confirmations are on in the stubs)
+    CHECK(command("t1231CC5A") == SLCAN_OK);
+    CHECK(stub_tx_header.DLC == 1 && stub_tx_data[0] == 0xCC && stub_tx_tag == 0x5A);
+
+    // Malformed transmit commands
+    CHECK(command("t12") == SLCAN_ERR_LEN);
+    CHECK(command("t1232AA") == SLCAN_ERR_LEN);
+    CHECK(command("t1232AABBC") == SLCAN_ERR_LEN);
+    CHECK(command("T1234567") == SLCAN_ERR_LEN);
+    CHECK(command("r0018AABB") == SLCAN_ERR_LEN);
+    CHECK(command("t12G0") == SLCAN_ERR_HEX);
+    CHECK(command("t1231G0") == SLCAN_ERR_HEX);
+    CHECK(command("T1234567G0") == SLCAN_ERR_HEX);
+    CHECK(command("t8000") == SLCAN_ERR_RANGE);
+    CHECK(command("T200000000") == SLCAN_ERR_RANGE);
+    CHECK(command("t1239") == SLCAN_ERR_RANGE);
+
+    // Other malformed commands
+    CHECK(command("") == SLCAN_ERR_LEN);
+    CHECK(command("?") == SLCAN_ERR_CMD);
+    CHECK(command("S") == SLCAN_ERR_LEN);
+    CHECK(command("Sx") == SLCAN_ERR_HEX);
+    CHECK(command("B2") == SLCAN_ERR_RANGE);
+
+    printf(failures ? "slcan_decode_test: %d failures\n" : "slcan_decode_test: ok\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,82 @@
+//
+// Stubs for the modules slcan.c calls, for host tests that include ../src/slcan.c.
+//
+
+#include <string.h>
+#include "stm32f0xx_hal.h"
+#include "can.h"
+#include "filter.h"
+#include "binproto.h"
+#include "error.h"
+#include "printf.h"
+#include "usbd_cdc_if.h"
+#include "slcan_stubs.h"
+
+CAN_TxHeaderTypeDef stub_tx_header;
+uint8_t stub_tx_data[8];
+uint8_t stub_tx_tag;
+uint32_t stub_tx_count;
+
+uint8_t stub_rx_seq_enabled;
+uint16_t stub_rx_seq;
+
+uint8_t stub_cdc_out[256];
+uint16_t stub_cdc_len;
+
+static ring_t stub_ring;
+static can_rxstats_t stub_rxstats;
+static filter_stats_t stub_filter_stats;
+
+uint32_t can_tx(CAN_TxHeaderTypeDef *tx_msg_header, uint8_t *tx_msg_data, uint8_t tag)
+{
+    stub_tx_header = *tx_msg_header;
+    memcpy(stub_tx_data, tx_msg_data, 8);
+    stub_tx_tag = tag;
+    stub_tx_count++;
+    return HAL_OK;
+}
+
+uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len)
+{
+    if (stub_cdc_len + Len <= sizeof(stub_cdc_out))
+    {
+        memcpy(&stub_cdc_out[stub_cdc_len], Buf, Len);
+        stub_cdc_len += Len;
+    }
+    return USBD_OK;
+}
+
+uint8_t can_get_rx_seq(void) { return stub_rx_seq_enabled; }
+uint16_t can_rx_seq(void) { return stub_rx_seq; }
+uint8_t can_get_txconf(void) { return 1; }
+
+void _putchar(char character) {}
+uint8_t binproto_enabled(void) { return 0; }
+void binproto_send(uint8_t type, uint8_t *payload, uint8_t len) {}
+void binproto_set_enabled(uint8_t enabled) {}
+void can_disable(void) {}
+void can_enable(void) {}
+const ring_t* can_get_rxring(void) { return &stub_ring; }
+const can_rxstats_t* can_get_rxstats(void) { return &stub_rxstats; }
+const ring_t* can_get_txconfring(void) { return &stub_ring; }
+void can_set_autoretransmit(uint8_t autoretransmit) {}
+void can_set_bitrate(enum can_bitrate bitrate) {}
+HAL_StatusTypeDef can_set_bittiming(uint32_t bitrate, uint32_t sample_point) { return HAL_OK; }
+HAL_StatusTypeDef can_set_btr(uint32_t btr) { return HAL_OK; }
+void can_set_credits(uint8_t enable) {}
+void can_set_fifo_mode(enum can_fifo_mode mode) {}
+void can_set_rx_policy(enum can_rx_policy policy) {}
+void can_set_rx_seq(uint8_t enable) {}
+void can_set_silent(uint8_t silent) {}
+HAL_StatusTypeDef can_set_tx_order(enum can_tx_order order) { return HAL_OK; }
+void can_set_txconf(uint8_t enable) {}
+const ring_t* cdc_get_rxring(void) { return &stub_ring; }
+const ring_t* cdc_get_txring(void) { return &stub_ring; }
+uint32_t error_reg(void) { return 0; }
+HAL_StatusTypeDef filter_add_ext(uint32_t id) { return HAL_OK; }
+HAL_StatusTypeDef filter_add_std(uint32_t id, uint32_t mask) { return HAL_OK; }
+HAL_StatusTypeDef filter_add_urgent(uint32_t ide, uint32_t id, uint32_t mask) { return HAL_OK; }
+uint8_t filter_banks_used(void) { return 0; }
+void filter_clear(void) {}
+void filter_clear_urgent(void) {}
+const filter_stats_t* filter_get_stats(void) { return &stub_filter_stats; }
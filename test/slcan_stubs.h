@@ -0,0 +1,22 @@
+//
+// Stubs for the modules slcan.c calls, for host tests that include ../src/slcan.c.
+// Frames passed to can_tx and bytes passed to CDC_Transmit_FS are recorded here.
+//
+
+#ifndef _SLCAN_STUBS_H
+#define _SLCAN_STUBS_H
+
+#include "stm32f0xx_hal.h"
+
+extern CAN_TxHeaderTypeDef stub_tx_header;
+extern uint8_t stub_tx_data[8];
+extern uint8_t stub_tx_tag;
+extern uint32_t stub_tx_count;
+
+extern uint8_t stub_rx_seq_enabled;
+extern uint16_t stub_rx_seq;
+
+extern uint8_t stub_cdc_out[256];
+extern uint16_t stub_cdc_len;
+
+#endif // _SLCAN_STUBS_H